@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_cache.h"
+#include "crc32c.h"
+#include "disk_emu.h"
+
+/*-------------------------------------------------------------------*/
+/*Write-back buffer cache keyed by block number. Entries live in one */
+/*array, are found through a chained hash table and are kept on a    */
+/*doubly linked list in LRU order (head is most recently used).      */
+/*Dirty entries reach the disk on eviction or on cache_flush.        */
+/*Prefetched entries stay busy until their read has been reaped.     */
+/*-------------------------------------------------------------------*/
+
+#define NO_ENTRY -1
+
+typedef struct cache_entry {
+    int block;
+    int dirty;
+    int busy;
+    int loading;
+    int prev, next;
+    int hash_next;
+    char *data;
+} cache_entry_t;
+
+static cache_entry_t *entries = NULL;
+static char *cache_data = NULL;
+static int *hash_heads = NULL;
+static int num_entries, hash_mask, cache_block_size;
+static int lru_head = NO_ENTRY, lru_tail = NO_ENTRY, free_list = NO_ENTRY;
+
+//preallocated so that no transfer needs the heap
+static disk_request_t *reqs = NULL;
+static int *slots = NULL;
+static char *scratch = NULL;
+
+//read-ahead requests, the one for entry e is ahead[e]
+static disk_request_t *ahead = NULL;
+static int num_loading = 0;
+
+//optional CRC32C per block, see cache_set_checksums
+static unsigned int *csums = NULL;
+static int csum_table_block, csum_table_len;
+static unsigned char *csum_dirty = NULL; //blocks of the table changed since they were written back
+
+//blocks of the table still on disk, see cache_set_checksums_lazy
+static unsigned char *csum_pending = NULL;
+static char *csum_buffer = NULL;
+static int csum_entries;
+
+static int hash_block(int block) {
+    return (int) (((unsigned int) block * 2654435761u) & (unsigned int) hash_mask);
+}
+
+static void lru_unlink(int e) {
+    if (entries[e].prev != NO_ENTRY) entries[entries[e].prev].next = entries[e].next;
+    else lru_head = entries[e].next;
+    if (entries[e].next != NO_ENTRY) entries[entries[e].next].prev = entries[e].prev;
+    else lru_tail = entries[e].prev;
+    entries[e].prev = entries[e].next = NO_ENTRY;
+}
+
+static void lru_push_front(int e) {
+    entries[e].prev = NO_ENTRY;
+    entries[e].next = lru_head;
+    if (lru_head != NO_ENTRY) entries[lru_head].prev = e;
+    lru_head = e;
+    if (lru_tail == NO_ENTRY) lru_tail = e;
+}
+
+static int lookup(int block) {
+    for (int e = hash_heads[hash_block(block)]; e != NO_ENTRY; e = entries[e].hash_next) {
+        if (entries[e].block == block) return e;
+    }
+    return NO_ENTRY;
+}
+
+static void hash_remove(int e) {
+    int *link = &hash_heads[hash_block(entries[e].block)];
+    while (*link != e) link = &entries[*link].hash_next;
+    *link = entries[e].hash_next;
+}
+
+static int write_back(int e) {
+    if (!entries[e].dirty) return 0;
+    if (write_blocks(entries[e].block, 1, entries[e].data) < 0) return -1;
+    entries[e].dirty = 0;
+    return 0;
+}
+
+//finds a slot for block, evicting the least recently used idle entry if needed
+static int allocate(int block) {
+    int e = free_list;
+
+    if (e != NO_ENTRY) {
+        free_list = entries[e].next;
+    } else {
+        for (e = lru_tail; e != NO_ENTRY && entries[e].busy; e = entries[e].prev);
+        if (e == NO_ENTRY) return NO_ENTRY;
+        if (write_back(e) < 0) return NO_ENTRY;
+        lru_unlink(e);
+        hash_remove(e);
+    }
+
+    entries[e].block = block;
+    entries[e].dirty = 0;
+    entries[e].busy = 0;
+    entries[e].loading = 0;
+    entries[e].hash_next = hash_heads[hash_block(block)];
+    hash_heads[hash_block(block)] = e;
+    lru_push_front(e);
+    return e;
+}
+
+//forgets an entry without writing it back, so garbage is not kept around
+static void drop(int e) {
+    lru_unlink(e);
+    hash_remove(e);
+    entries[e].block = NO_ENTRY;
+    entries[e].dirty = 0;
+    entries[e].next = free_list;
+    free_list = e;
+}
+
+static void touch(int e) {
+    lru_unlink(e);
+    lru_push_front(e);
+}
+
+//puts every entry back on the free list
+static void reset_entries() {
+    for (int i = 0; i <= hash_mask; i++) hash_heads[i] = NO_ENTRY;
+    num_loading = 0;
+    for (int e = 0; e < num_entries; e++) {
+        entries[e].block = NO_ENTRY;
+        entries[e].dirty = 0;
+        entries[e].busy = 0;
+        entries[e].loading = 0;
+        entries[e].data = cache_data + (size_t) e * cache_block_size;
+        entries[e].next = e + 1 < num_entries ? e + 1 : NO_ENTRY;
+    }
+    free_list = 0;
+    lru_head = lru_tail = NO_ENTRY;
+}
+
+int cache_init(int block_size, int budget_bytes) {
+    int buckets = 1;
+
+    cache_close();
+    cache_block_size = block_size;
+    num_entries = budget_bytes / block_size;
+    if (num_entries < 1) num_entries = 1;
+    while (buckets < num_entries) buckets <<= 1;
+    hash_mask = buckets - 1;
+
+    //every allocation goes through disk_alloc_buffer so it is counted
+    entries = disk_alloc_buffer((size_t) num_entries * sizeof(cache_entry_t));
+    cache_data = disk_alloc_buffer((size_t) num_entries * block_size);
+    hash_heads = disk_alloc_buffer(buckets * sizeof(int));
+    reqs = disk_alloc_buffer((size_t) num_entries * sizeof(disk_request_t));
+    slots = disk_alloc_buffer((size_t) num_entries * sizeof(int));
+    scratch = disk_alloc_buffer(2 * (size_t) block_size);
+    ahead = disk_alloc_buffer((size_t) num_entries * sizeof(disk_request_t));
+    if (!entries || !cache_data || !hash_heads || !reqs || !slots || !scratch || !ahead) {
+        fprintf(stderr, "Could not allocate %d byte block cache\n", budget_bytes);
+        cache_close();
+        return -1;
+    }
+    reset_entries();
+    return 0;
+}
+
+int cache_close() {
+    int res = 0;
+    if (entries && cache_data && reqs) res = cache_flush(); //also waits for read-ahead
+    disk_free_buffer(entries);
+    disk_free_buffer(cache_data);
+    disk_free_buffer(hash_heads);
+    disk_free_buffer(reqs);
+    disk_free_buffer(slots);
+    disk_free_buffer(scratch);
+    disk_free_buffer(ahead);
+    entries = NULL;
+    cache_data = NULL;
+    hash_heads = NULL;
+    reqs = NULL;
+    slots = NULL;
+    scratch = NULL;
+    ahead = NULL;
+    return res;
+}
+
+//the part of block i of a run that overlaps [skip, skip + length)
+static int slice(int i, int skip, int length, int *in_block, int *in_range) {
+    int start = i * cache_block_size, from = start > skip ? start : skip,
+            to = start + cache_block_size < skip + length ? start + cache_block_size : skip + length;
+    *in_block = from - start;
+    *in_range = from - skip;
+    return to - from;
+}
+
+/*-------------------------------------------------------------------*/
+/*Keeps table[b] equal to the CRC32C of block b as blocks are written*/
+/*through the cache and checks it whenever a block is read from disk.*/
+/*The table_len blocks starting at table_block hold the table itself */
+/*and are not covered; an entry of 0 means no checksum is known yet. */
+/*Passing NULL turns checksums off.                                  */
+/*-------------------------------------------------------------------*/
+int cache_set_checksums(unsigned int *table, int table_block, int table_len) {
+    disk_free_buffer(csum_dirty);
+    disk_free_buffer(csum_pending);
+    disk_free_buffer(csum_buffer);
+    csum_dirty = NULL;
+    csum_pending = NULL;
+    csum_buffer = NULL;
+    csums = NULL;
+    if (!table) return 0;
+
+    csum_dirty = disk_alloc_buffer(table_len);
+    if (!csum_dirty) return -1;
+    memset(csum_dirty, 0, table_len);
+    csums = table;
+    csum_table_block = table_block;
+    csum_table_len = table_len;
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*The same for a table that is still on disk, with room for          */
+/*num_blocks entries: each block of it is read in the first time one */
+/*of its entries is needed, so opening a large disk does not read    */
+/*the whole table. A block that cannot be read counts as all 0.      */
+/*-------------------------------------------------------------------*/
+int cache_set_checksums_lazy(unsigned int *table, int table_block, int table_len, int num_blocks) {
+    if (cache_set_checksums(table, table_block, table_len) < 0) return -1;
+    csum_pending = disk_alloc_buffer(table_len);
+    csum_buffer = disk_alloc_buffer(cache_block_size);
+    if (!csum_pending || !csum_buffer) {
+        cache_set_checksums(NULL, 0, 0);
+        return -1;
+    }
+    memset(csum_pending, 1, table_len);
+    csum_entries = num_blocks;
+    return 0;
+}
+
+//a flag for each block of the table, set when an entry in it changes; whoever writes
+//the block back clears it. Blocks never read in are never set
+unsigned char *cache_checksums_dirty() {
+    return csum_dirty;
+}
+
+static void csum_load(int block) {
+    int per_page = cache_block_size / (int) sizeof(unsigned int), page = block / per_page;
+    int n = csum_entries - page * per_page < per_page ? csum_entries - page * per_page : per_page;
+
+    if (!csum_pending || !csum_pending[page]) return;
+    if (read_blocks(csum_table_block + page, 1, csum_buffer) < 1) {
+        fprintf(stderr, "Could not read checksum table block %d\n", csum_table_block + page);
+        memset(csum_buffer, 0, cache_block_size);
+    }
+    memcpy(&csums[page * per_page], csum_buffer, n * sizeof(unsigned int));
+    csum_pending[page] = 0;
+}
+
+static int csum_covers(int block) {
+    return csums && (block < csum_table_block || block >= csum_table_block + csum_table_len);
+}
+
+static void csum_update(int block, const char *data) {
+    unsigned int sum;
+
+    if (!csum_covers(block)) return;
+    csum_load(block);
+    sum = crc32c(0, data, cache_block_size);
+    if (csums[block] == sum) return;
+    csums[block] = sum;
+    csum_dirty[block / (cache_block_size / (int) sizeof(unsigned int))] = 1;
+}
+
+static int csum_check(int block, const char *data) {
+    if (!csum_covers(block)) return 0;
+    csum_load(block);
+    if (!csums[block]) return 0;
+    if (crc32c(0, data, cache_block_size) == csums[block]) return 0;
+    fprintf(stderr, "Checksum mismatch in block %d\n", block);
+    return -1;
+}
+
+/*-------------------------------------------------------------------*/
+/*Read-ahead. cache_prefetch submits reads for blocks that are not   */
+/*cached and returns without waiting. Their entries are pinned and  */
+/*marked loading until the completion is reaped: when the block is   */
+/*asked for, or before the cache runs any other batch through the    */
+/*request queue, which must not see these completions.               */
+/*-------------------------------------------------------------------*/
+static void prefetch_done(disk_request_t *req) {
+    int e = (int) (req - ahead);
+
+    entries[e].loading = 0;
+    entries[e].busy = 0;
+    num_loading--;
+    if (req->result < 0 || csum_check(entries[e].block, entries[e].data) < 0) drop(e);
+}
+
+//reaps at least min_complete read-ahead completions, or gives them all up if the engine fails
+static void prefetch_reap(int min_complete) {
+    disk_request_t *done[64];
+    int got = disk_reap(min_complete, done, 64);
+
+    if (got < 0 || (got == 0 && min_complete > 0)) {
+        for (int e = 0; e < num_entries; e++) {
+            if (!entries[e].loading) continue;
+            ahead[e].result = -1;
+            prefetch_done(&ahead[e]);
+        }
+        return;
+    }
+    for (int i = 0; i < got; i++) prefetch_done(done[i]);
+}
+
+static void prefetch_wait(int e) {
+    while (entries[e].loading) prefetch_reap(1);
+}
+
+static void prefetch_wait_all() {
+    while (num_loading > 0) prefetch_reap(1);
+}
+
+//at most half the cache is given to blocks that nobody asked for yet
+int cache_prefetch(const unsigned int *blocks, int nblocks) {
+    int started = 0;
+
+    if (!entries) return 0;
+    for (int i = 0; i < nblocks && num_loading < num_entries / 2; i++) {
+        if (lookup(blocks[i]) != NO_ENTRY) continue;
+        int e = allocate(blocks[i]);
+        if (e == NO_ENTRY) break;
+
+        ahead[e].op = DISK_OP_READ;
+        ahead[e].start_address = blocks[i];
+        ahead[e].nblocks = 1;
+        ahead[e].buffer = entries[e].data;
+        if (disk_submit(&ahead[e]) < 0) {
+            drop(e);
+            break;
+        }
+        entries[e].busy = 1;
+        entries[e].loading = 1;
+        num_loading++;
+        started++;
+    }
+    //hands the new requests to the kernel and picks up any that already finished
+    if (started) prefetch_reap(0);
+    return started;
+}
+
+int cache_read(int block, void *buffer) {
+    unsigned int b = (unsigned int) block;
+    return cache_readv(&b, 1, buffer);
+}
+
+int cache_readv(const unsigned int *blocks, int nblocks, void *buffer) {
+    return cache_read_bytes(blocks, nblocks, 0, nblocks * cache_block_size, buffer);
+}
+
+/*-------------------------------------------------------------------*/
+/*Copies length bytes, starting skip bytes into the first of the     */
+/*listed blocks, into dest. Hits are copied straight out of the      */
+/*cache and all misses go to disk together in one batch.             */
+/*-------------------------------------------------------------------*/
+int cache_read_bytes(const unsigned int *blocks, int nblocks, int skip, int length, void *dest) {
+    int failed = 0, done = 0, in_block, in_range, len;
+
+    while (done < nblocks) {
+        int batch_end, num_reqs = 0;
+
+        //every entry used by a batch stays pinned until its data is copied out
+        for (batch_end = done; batch_end < nblocks && batch_end - done < num_entries; batch_end++) {
+            int e = lookup(blocks[batch_end]);
+            if (e != NO_ENTRY) prefetch_wait(e);
+            e = lookup(blocks[batch_end]);
+            if (e != NO_ENTRY) {
+                touch(e);
+                entries[e].busy = 1;
+                slots[batch_end - done] = e;
+                continue;
+            }
+
+            len = slice(batch_end, skip, length, &in_block, &in_range);
+            reqs[num_reqs].op = DISK_OP_READ;
+            reqs[num_reqs].start_address = blocks[batch_end];
+            reqs[num_reqs].nblocks = 1;
+            e = allocate(blocks[batch_end]);
+            if (e != NO_ENTRY) {
+                entries[e].busy = 1;
+                reqs[num_reqs].buffer = entries[e].data;
+            } else if (len == cache_block_size) {
+                //everything is pinned by this batch: read straight into the caller's buffer
+                reqs[num_reqs].buffer = (char *) dest + in_range;
+            } else {
+                //only the first and last block of a run can be partial
+                reqs[num_reqs].buffer = scratch + (batch_end == 0 ? 0 : cache_block_size);
+            }
+            slots[batch_end - done] = e;
+            num_reqs++;
+        }
+
+        prefetch_wait_all();
+        if (disk_run(reqs, num_reqs)) failed = 1;
+        for (int r = 0; r < num_reqs; r++) {
+            if (reqs[r].result < 0 || csum_check(reqs[r].start_address, reqs[r].buffer) == 0) continue;
+            reqs[r].result = -1;
+            failed = 1;
+        }
+
+        for (int i = done; i < batch_end; i++) {
+            int e = slots[i - done];
+            len = slice(i, skip, length, &in_block, &in_range);
+            if (e != NO_ENTRY) {
+                if (len > 0) memcpy((char *) dest + in_range, entries[e].data + in_block, len);
+                continue;
+            }
+            if (len > 0 && len < cache_block_size) {
+                memcpy((char *) dest + in_range, scratch + (i == 0 ? 0 : cache_block_size) + in_block, len);
+            }
+        }
+        for (int i = done; i < batch_end; i++) {
+            if (slots[i - done] != NO_ENTRY) entries[slots[i - done]].busy = 0;
+        }
+        for (int r = 0; r < num_reqs; r++) {
+            int e = lookup(reqs[r].start_address);
+            if (reqs[r].result >= 0 || e == NO_ENTRY) continue;
+            drop(e);
+        }
+        done = batch_end;
+    }
+    return failed ? -1 : nblocks;
+}
+
+int cache_write(int block, const void *buffer) {
+    unsigned int b = (unsigned int) block;
+    return cache_writev(&b, 1, buffer);
+}
+
+//overwrites whole blocks in the cache; they are written back later
+int cache_writev(const unsigned int *blocks, int nblocks, const void *buffer) {
+    return cache_write_bytes(blocks, nblocks, 0, nblocks * cache_block_size, buffer, 0);
+}
+
+/*-------------------------------------------------------------------*/
+/*Copies length bytes from src into the listed blocks, starting skip */
+/*bytes into the first one. Only the first old_bytes of the run hold */
+/*data worth keeping: partially written blocks before that point are */
+/*read in first, those after it are zero filled, cached or not.      */
+/*-------------------------------------------------------------------*/
+int cache_write_bytes(const unsigned int *blocks, int nblocks, int skip, int length,
+                      const void *src, int old_bytes) {
+    int in_block, in_range, len;
+
+    for (int i = 0; i < nblocks; i++) {
+        int e = lookup(blocks[i]), hit;
+        char *data;
+
+        if (e != NO_ENTRY) prefetch_wait(e);
+        e = lookup(blocks[i]);
+        hit = e != NO_ENTRY;
+
+        len = slice(i, skip, length, &in_block, &in_range);
+        if (len <= 0) continue;
+
+        if (hit) touch(e);
+        else e = allocate(blocks[i]);
+        data = e != NO_ENTRY ? entries[e].data : scratch;
+
+        if (len < cache_block_size && i * cache_block_size >= old_bytes) {
+            //a cached copy may still hold what a removed file left in the block
+            memset(data, 0, cache_block_size);
+        } else if (!hit && len < cache_block_size) {
+            if (read_blocks(blocks[i], 1, data) < 0 || csum_check(blocks[i], data) < 0) {
+                if (e != NO_ENTRY) drop(e);
+                return -1;
+            }
+        }
+        memcpy(data + in_block, (const char *) src + in_range, len);
+        csum_update(blocks[i], data);
+
+        if (e == NO_ENTRY) {
+            if (write_blocks(blocks[i], 1, data) < 0) return -1;
+            continue;
+        }
+        entries[e].dirty = 1;
+    }
+    return nblocks;
+}
+
+static void queue_write_back(int e, int *num_reqs) {
+    if (e == NO_ENTRY || entries[e].block == NO_ENTRY || !entries[e].dirty) return;
+    reqs[*num_reqs].op = DISK_OP_WRITE;
+    reqs[*num_reqs].start_address = entries[e].block;
+    reqs[*num_reqs].nblocks = 1;
+    reqs[*num_reqs].buffer = entries[e].data;
+    entries[e].dirty = 0;
+    (*num_reqs)++;
+}
+
+static int run_write_back(int num_reqs) {
+    prefetch_wait_all();
+    int failed = disk_run(reqs, num_reqs);
+    for (int i = 0; i < num_reqs; i++) {
+        if (reqs[i].result < 0) entries[lookup(reqs[i].start_address)].dirty = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+//writes every dirty block back to disk, all in one batch
+int cache_flush() {
+    int num_reqs = 0;
+
+    if (!entries) return 0;
+    for (int e = 0; e < num_entries; e++) queue_write_back(e, &num_reqs);
+    return run_write_back(num_reqs);
+}
+
+//writes back only the listed blocks that are dirty, again in one batch
+int cache_flush_blocks(const unsigned int *blocks, int nblocks) {
+    int num_reqs = 0;
+
+    if (!entries) return 0;
+    for (int i = 0; i < nblocks; i++) queue_write_back(lookup(blocks[i]), &num_reqs);
+    return run_write_back(num_reqs);
+}
+
+//drops every entry without writing it, for when the disk underneath is replaced
+void cache_invalidate() {
+    if (!entries) return;
+    prefetch_wait_all();
+    reset_entries();
+}
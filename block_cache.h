@@ -0,0 +1,16 @@
+int cache_init(int block_size, int budget_bytes);
+int cache_close();
+int cache_read(int block, void *buffer);
+int cache_readv(const unsigned int *blocks, int nblocks, void *buffer);
+int cache_read_bytes(const unsigned int *blocks, int nblocks, int skip, int length, void *dest);
+int cache_prefetch(const unsigned int *blocks, int nblocks);
+int cache_write(int block, const void *buffer);
+int cache_writev(const unsigned int *blocks, int nblocks, const void *buffer);
+int cache_write_bytes(const unsigned int *blocks, int nblocks, int skip, int length,
+                      const void *src, int old_bytes);
+int cache_flush();
+int cache_flush_blocks(const unsigned int *blocks, int nblocks);
+void cache_invalidate();
+int cache_set_checksums(unsigned int *table, int table_block, int table_len);
+int cache_set_checksums_lazy(unsigned int *table, int table_block, int table_len, int num_blocks);
+unsigned char *cache_checksums_dirty();
@@ -0,0 +1,129 @@
+#include <string.h>
+#include <stdint.h>
+#include "compress.h"
+
+/*-------------------------------------------------------------------*/
+/*Byte oriented LZ77 compressor writing the LZ4 block format: each   */
+/*sequence is a token (literal count and match length, four bits     */
+/*each), the literals, a two byte little endian offset and the match */
+/*length beyond the minimum of 4, with 255 bytes extending a count.  */
+/*The last 5 bytes are always literals and no match starts in the    */
+/*last 12, as the format requires.                                   */
+/*-------------------------------------------------------------------*/
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash4(const unsigned char *p) {
+    return (int) ((read32(p) * 2654435761u) >> (32 - HASH_BITS));
+}
+
+//writes a count that did not fit in its 4 bit field
+static unsigned char *put_length(unsigned char *op, unsigned char *end, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end, const unsigned char *literals,
+                                   int num_literals, int offset, int match_len) {
+    unsigned char *token;
+
+    if (op >= end) return NULL;
+    token = op++;
+    *token = (unsigned char) ((num_literals < 15 ? num_literals : 15) << 4);
+    if (num_literals >= 15 && !(op = put_length(op, end, num_literals - 15))) return NULL;
+    if (op + num_literals > end) return NULL;
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+    if (!offset) return op; //the last sequence has no match
+
+    if (op + 2 > end) return NULL;
+    *op++ = (unsigned char) offset;
+    *op++ = (unsigned char) (offset >> 8);
+    match_len -= MIN_MATCH;
+    *token |= (unsigned char) (match_len < 15 ? match_len : 15);
+    if (match_len >= 15 && !(op = put_length(op, end, match_len - 15))) return NULL;
+    return op;
+}
+
+//returns the compressed size, or 0 when it would not fit in capacity bytes
+int lz_compress(const void *src, int len, void *dst, int capacity) {
+    const unsigned char *in = src, *ip = in, *anchor = in;
+    const unsigned char *limit = in + (len > LAST_LITERALS ? len - LAST_LITERALS : 0);
+    unsigned char *op = dst, *end = op + capacity;
+    int table[1 << HASH_BITS];
+
+    for (int i = 0; i < (1 << HASH_BITS); i++) table[i] = -1;
+
+    while (len > MATCH_LIMIT && ip < in + len - MATCH_LIMIT) {
+        int h = hash4(ip), candidate = table[h];
+        table[h] = (int) (ip - in);
+
+        if (candidate < 0 || ip - (in + candidate) > MAX_OFFSET || read32(in + candidate) != read32(ip)) {
+            ip++;
+            continue;
+        }
+
+        const unsigned char *match = in + candidate, *mp = ip + MIN_MATCH;
+        while (mp < limit && *mp == match[mp - ip]) mp++;
+        if (!(op = put_sequence(op, end, anchor, (int) (ip - anchor), (int) (ip - match), (int) (mp - ip)))) {
+            return 0;
+        }
+        ip = anchor = mp;
+    }
+
+    if (!(op = put_sequence(op, end, anchor, (int) (in + len - anchor), 0, 0))) return 0;
+    return (int) (op - (unsigned char *) dst);
+}
+
+//returns the decompressed size, or -1 if the input is malformed or does not fit
+int lz_decompress(const void *src, int len, void *dst, int capacity) {
+    const unsigned char *ip = src, *in_end = ip + len;
+    unsigned char *op = dst, *out = dst, *end = op + capacity;
+
+    while (ip < in_end) {
+        int token = *ip++, num_literals = token >> 4, match_len = token & 15, offset;
+
+        if (num_literals == 15) {
+            do {
+                if (ip >= in_end) return -1;
+                num_literals += *ip;
+            } while (*ip++ == 255);
+        }
+        if (ip + num_literals > in_end || op + num_literals > end) return -1;
+        memcpy(op, ip, num_literals);
+        ip += num_literals;
+        op += num_literals;
+        if (ip == in_end) break; //last sequence
+
+        if (ip + 2 > in_end) return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - out) return -1;
+        if (match_len == 15) {
+            do {
+                if (ip >= in_end) return -1;
+                match_len += *ip;
+            } while (*ip++ == 255);
+        }
+        match_len += MIN_MATCH;
+        if (op + match_len > end) return -1;
+        //byte by byte, matches may overlap their own output
+        for (const unsigned char *mp = op - offset; match_len-- > 0;) *op++ = *mp++;
+    }
+    return (int) (op - out);
+}
@@ -0,0 +1,2 @@
+int lz_compress(const void *src, int len, void *dst, int capacity);
+int lz_decompress(const void *src, int len, void *dst, int capacity);
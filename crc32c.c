@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM
+#endif
+
+/*-------------------------------------------------------------------*/
+/*CRC32C (Castagnoli). Uses the SSE4.2 or ARMv8 CRC instructions when*/
+/*the CPU has them and slicing-by-8 tables otherwise. crc is the     */
+/*value returned for the previous part of the data, 0 to start.      */
+/*-------------------------------------------------------------------*/
+
+#define POLY 0x82f63b78u
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t table[8][256];
+static crc_fn engine = NULL;
+static const char *engine_name = NULL;
+
+static void build_tables() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t) i;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+    }
+}
+
+static uint32_t crc_software(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t) p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    //eight bytes per step, assembled little endian whatever the host order
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+        uint32_t hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/*-------------------------------------------------------------------*/
+/*The CRC instructions take three cycles but can start one per cycle,*/
+/*so long buffers are cut into three lanes that are run interleaved. */
+/*The lane CRCs are joined by shifting each over the lanes after it, */
+/*a multiplication by x^(8 * lane bytes) modulo the polynomial.      */
+/*-------------------------------------------------------------------*/
+#if defined(__x86_64__) || defined(CRC32C_ARM)
+#define LANE_MIN 256
+
+//a * b modulo the polynomial, both reflected
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t) 1 << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+//x^(8 * len) modulo the polynomial, remembered for the last length asked for
+static uint32_t lane_shift(size_t len) {
+    static size_t cached_len = 0;
+    static uint32_t cached = 0;
+    uint32_t p = (uint32_t) 1 << 31, x2n = (uint32_t) 1 << 30;
+    size_t n = len * 8;
+
+    if (len == cached_len) return cached;
+    //walk the bits of n, squaring x^(2^k) as we go
+    for (; n; n >>= 1) {
+        if (n & 1) p = multmodp(x2n, p);
+        x2n = multmodp(x2n, x2n);
+    }
+    cached_len = len;
+    cached = p;
+    return p;
+}
+#endif
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t) p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    if (len >= 3 * LANE_MIN) {
+        size_t lane = len / 24 * 8;
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        for (size_t i = 0; i < lane; i += 8) {
+            c0 = _mm_crc32_u64(c0, *(const uint64_t *) (p + i));
+            c1 = _mm_crc32_u64(c1, *(const uint64_t *) (p + lane + i));
+            c2 = _mm_crc32_u64(c2, *(const uint64_t *) (p + 2 * lane + i));
+        }
+        uint32_t shift = lane_shift(lane);
+        crc = multmodp(shift, multmodp(shift, (uint32_t) c0) ^ (uint32_t) c1) ^ (uint32_t) c2;
+        p += 3 * lane;
+        len -= 3 * lane;
+    }
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) crc64 = _mm_crc32_u64(crc64, *(const uint64_t *) p);
+    crc = (uint32_t) crc64;
+#endif
+    for (; len >= 4; p += 4, len -= 4) crc = _mm_crc32_u32(crc, *(const uint32_t *) p);
+    while (len-- > 0) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static uint32_t crc_armv8(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t) p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    if (len >= 3 * LANE_MIN) {
+        size_t lane = len / 24 * 8;
+        uint32_t c0 = crc, c1 = 0, c2 = 0;
+        for (size_t i = 0; i < lane; i += 8) {
+            c0 = __crc32cd(c0, *(const uint64_t *) (p + i));
+            c1 = __crc32cd(c1, *(const uint64_t *) (p + lane + i));
+            c2 = __crc32cd(c2, *(const uint64_t *) (p + 2 * lane + i));
+        }
+        uint32_t shift = lane_shift(lane);
+        crc = multmodp(shift, multmodp(shift, c0) ^ c1) ^ c2;
+        p += 3 * lane;
+        len -= 3 * lane;
+    }
+    for (; len >= 8; p += 8, len -= 8) crc = __crc32cd(crc, *(const uint64_t *) p);
+    while (len-- > 0) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static void pick_engine() {
+    build_tables();
+    engine = crc_software;
+    engine_name = "slicing-by-8";
+#ifdef CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        engine = crc_sse42;
+        engine_name = "sse4.2";
+    }
+#endif
+#ifdef CRC32C_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        engine = crc_armv8;
+        engine_name = "armv8 crc";
+    }
+#endif
+}
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t len) {
+    if (!engine) pick_engine();
+    return ~engine(~(uint32_t) crc, data, len);
+}
+
+const char *crc32c_engine() {
+    if (!engine) pick_engine();
+    return engine_name;
+}
+
+//for benchmarks: stick to the table driven version even on capable CPUs
+void crc32c_force_software(int on) {
+    pick_engine();
+    if (on) {
+        engine = crc_software;
+        engine_name = "slicing-by-8";
+    }
+}
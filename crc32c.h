@@ -0,0 +1,5 @@
+#include <stddef.h>
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t len);
+const char *crc32c_engine();
+void crc32c_force_software(int on);
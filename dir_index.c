@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "dir_index.h"
+
+/*-------------------------------------------------------------------*/
+/*Hashed directory: the hash of a name picks the directory block the */
+/*entry goes in, its home block. When that block is full the entry   */
+/*goes in the next one with a free slot, and every block passed over */
+/*counts one more spill. A lookup reads the home block and goes on   */
+/*only past blocks whose spill count is not zero, so with the        */
+/*directory less than full it reads one block, two now and then,     */
+/*whatever the number of entries. Deleting an entry takes its spills */
+/*back, so no tombstones are left behind. The spill and used counts  */
+/*are not stored; dir_init works them out from the entries.          */
+/*Slot 0 is never handed out, so that 0 can mean no entry.           */
+/*-------------------------------------------------------------------*/
+
+unsigned long dir_blocks_scanned = 0;
+
+static dir_entry_t *dir;
+static unsigned int *spill, *used;
+static unsigned int num_blocks, per_block;
+
+//32 bit FNV-1a
+unsigned int dir_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name; name++) h = (h ^ (unsigned char) *name) * 16777619u;
+    return h;
+}
+
+static unsigned int home_block(const char *name) {
+    return dir_hash(name) % num_blocks;
+}
+
+//counts a spill on every block from home up to, not including, block
+static void add_spills(unsigned int home, unsigned int block, int n) {
+    for (unsigned int b = home; b != block; b = (b + 1) % num_blocks) spill[b] += n;
+}
+
+//takes over entries, num_blocks blocks of per_block of them, as loaded or zeroed
+int dir_init(dir_entry_t *entries, unsigned int blocks, unsigned int entries_per_block) {
+    dir_close();
+    dir = entries;
+    num_blocks = blocks;
+    per_block = entries_per_block;
+    spill = calloc(num_blocks, sizeof(*spill));
+    used = calloc(num_blocks, sizeof(*used));
+    if (!spill || !used) {
+        dir_close();
+        return -1;
+    }
+
+    used[0] = 1; //slot 0
+    for (unsigned int slot = 1; slot < num_blocks * per_block; slot++) {
+        if (!dir[slot].inode_idx) continue;
+        used[slot / per_block]++;
+        add_spills(home_block(dir[slot].name), slot / per_block, 1);
+    }
+    return 0;
+}
+
+void dir_close() {
+    free(spill);
+    free(used);
+    spill = used = NULL;
+    dir = NULL;
+    num_blocks = per_block = 0;
+}
+
+//slot of the entry for name, 0 if there is none
+unsigned int dir_lookup(const char *name) {
+    unsigned int block = home_block(name);
+
+    for (unsigned int n = 0; n < num_blocks; n++, block = (block + 1) % num_blocks) {
+        dir_blocks_scanned++;
+        for (unsigned int slot = block * per_block; slot < (block + 1) * per_block; slot++) {
+            if (dir[slot].inode_idx && strcmp(dir[slot].name, name) == 0) return slot;
+        }
+        if (!spill[block]) break; //nothing from here on has its home before the next block
+    }
+    return 0;
+}
+
+//adds an entry, returns its slot or 0 when the directory is full
+unsigned int dir_insert(const char *name, unsigned int inode_idx) {
+    unsigned int home = home_block(name), block = home;
+
+    for (unsigned int n = 0; n < num_blocks; n++, block = (block + 1) % num_blocks) {
+        if (used[block] == per_block) continue;
+        for (unsigned int slot = block ? block * per_block : 1; slot < (block + 1) * per_block; slot++) {
+            if (dir[slot].inode_idx) continue;
+            strcpy(dir[slot].name, name);
+            dir[slot].inode_idx = inode_idx;
+            used[block]++;
+            add_spills(home, block, 1);
+            return slot;
+        }
+    }
+    return 0;
+}
+
+void dir_delete(unsigned int slot) {
+    if (!slot || !dir[slot].inode_idx) return;
+    add_spills(home_block(dir[slot].name), slot / per_block, -1);
+    used[slot / per_block]--;
+    dir[slot].inode_idx = UNAVAILABLE_INODE;
+    dir[slot].name[0] = '\0';
+}
@@ -0,0 +1,8 @@
+extern unsigned long dir_blocks_scanned; //directory blocks looked at by dir_lookup, for the benchmarks
+
+int dir_init(dir_entry_t *entries, unsigned int num_blocks, unsigned int per_block);
+void dir_close();
+unsigned int dir_hash(const char *name);
+unsigned int dir_lookup(const char *name);
+unsigned int dir_insert(const char *name, unsigned int inode_idx);
+void dir_delete(unsigned int slot);
@@ -1,24 +1,619 @@
+#define _GNU_SOURCE
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include "disk_emu.h"
 
+/*linux/fs.h, pulled in by io_uring.h, has its own BLOCK_SIZE*/
+#undef BLOCK_SIZE
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*O_DIRECT transfers need sector aligned memory; buffers handed out by*/
+/*disk_alloc_buffer are page aligned so they always qualify           */
+#define SECTOR_SIZE 512
+#define BUFFER_ALIGN 4096
+#define IS_ALIGNED(ptr) (((uintptr_t)(ptr) % SECTOR_SIZE) == 0)
 
 FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+static int disk_fd = -1;
+static int backend = DISK_BACKEND_STDIO;
+static char *disk_map = NULL;
+static size_t disk_map_len = 0;
+static char *bounce = NULL;
+disk_counters_t disk_counters;
+int BLOCK_SIZE, MAX_BLOCK;
+
+/*-------------------------------------------------------------------*/
+/*Device performance model. Every request costs a fixed latency, a   */
+/*seek cost proportional to how far the head moves and its transfer  */
+/*time at the bandwidth cap. Up to queue_depth requests are serviced */
+/*at once. In simulated mode the cost only advances a virtual clock; */
+/*otherwise the caller sleeps for it.                                */
+/*-------------------------------------------------------------------*/
+#define MAX_QUEUE_DEPTH 64
+
+static disk_model_t model = {
+    0.0,    /*no latency*/
+    0.0,    /*free seeks*/
+    0.0,    /*unlimited bandwidth*/
+    1,      /*one request at a time*/
+    -1.0,   /*never fail*/
+    3,      /*retry a failed block 3 times*/
+    0       /*real time*/
+};
+static double clock_us = 0.0;
+static double channel_free_us[MAX_QUEUE_DEPTH];
+static int head_position = 0;
+
+void disk_set_model(const disk_model_t *new_model)
+{
+    model = *new_model;
+    if (model.queue_depth < 1)
+        model.queue_depth = 1;
+    if (model.queue_depth > MAX_QUEUE_DEPTH)
+        model.queue_depth = MAX_QUEUE_DEPTH;
+    disk_reset_clock();
+}
+
+void disk_get_model(disk_model_t *current)
+{
+    *current = model;
+}
+
+/*Virtual time in microseconds since the last reset*/
+double disk_clock_us()
+{
+    return clock_us;
+}
+
+void disk_reset_clock()
+{
+    int i;
+
+    clock_us = 0.0;
+    head_position = 0;
+    for (i = 0; i < MAX_QUEUE_DEPTH; i++)
+        channel_free_us[i] = 0.0;
+}
+
+/*Cost of one request in microseconds; moves the head to its end*/
+static double request_cost(int start_address, int nblocks)
+{
+    double cost = model.op_latency_us;
+    int distance = start_address - head_position;
+
+    cost += model.seek_us_per_block * (distance < 0 ? -distance : distance);
+    if (model.bandwidth_mb_s > 0)
+        cost += (double)nblocks * BLOCK_SIZE / model.bandwidth_mb_s;
+    head_position = start_address + nblocks;
+    return cost;
+}
+
+/*Queues the request on the channel that frees up first and returns its completion time*/
+static double schedule(int start_address, int nblocks)
+{
+    double cost = request_cost(start_address, nblocks), begin;
+    int i, best = 0;
+
+    for (i = 1; i < model.queue_depth; i++)
+    {
+        if (channel_free_us[i] < channel_free_us[best])
+            best = i;
+    }
+    begin = channel_free_us[best] > clock_us ? channel_free_us[best] : clock_us;
+    channel_free_us[best] = begin + cost;
+    return begin + cost;
+}
+
+/*-------------------------------------------------------------------*/
+/*Charges a request to the model and returns when it completes. Each */
+/*block may fail with the configured probability and is retried up  */
+/*to max_retry times; *failed gets minus the blocks that never made  */
+/*it.                                                                */
+/*-------------------------------------------------------------------*/
+static double device_charge(int start_address, int nblocks, int *failed)
+{
+    double done_us = schedule(start_address, nblocks);
+    int i, attempt;
+
+    *failed = 0;
+    if (model.failure_prob > 0)
+    {
+        for (i = 0; i < nblocks; i++)
+        {
+            for (attempt = 0; attempt <= model.max_retry; attempt++)
+            {
+                if ((double)rand() / RAND_MAX >= model.failure_prob)
+                    break;
+                done_us = schedule(start_address + i, 1);
+            }
+            if (attempt > model.max_retry)
+                (*failed)--;
+        }
+    }
+    return done_us;
+}
+
+/*Pause until the latency duration is elapsed*/
+static void wait_until(double done_us)
+{
+    if (done_us <= clock_us)
+        return;
+    if (!model.simulated)
+        usleep((useconds_t)(done_us - clock_us));
+    clock_us = done_us;
+}
+
+/*Synchronous requests wait for their own completion*/
+static int device_access(int start_address, int nblocks)
+{
+    int e;
+
+    wait_until(device_charge(start_address, nblocks, &e));
+    return e;
+}
+
+/*-------------------------------------------------------------------*/
+/*I/O statistics. Every completed transfer is charged to the call    */
+/*site named by the last disk_stats_site call: operations, bytes and */
+/*a latency histogram per direction. Bucket 0 counts latencies under */
+/*1 us, bucket i those under 2^i us, the last one everything longer. */
+/*Latency is wall time plus, in simulated mode, virtual device time. */
+/*-------------------------------------------------------------------*/
+#define MAX_SITES 16
+
+typedef struct site_stats {
+    const char *name;
+    unsigned long ops[2];
+    unsigned long long bytes[2];
+    double total_us[2];
+    unsigned long histogram[2][DISK_STATS_BUCKETS];
+} site_stats_t;
+
+static site_stats_t sites[MAX_SITES] = { { "other" } };
+static int num_sites = 1, current_site = 0;
+static unsigned long long logical_bytes = 0;
+
+/*Charges the I/O that follows to site, a string that outlives the stats*/
+void disk_stats_site(const char *site)
+{
+    int i;
+
+    for (i = 0; i < num_sites; i++)
+    {
+        if (strcmp(sites[i].name, site) == 0)
+        {
+            current_site = i;
+            return;
+        }
+    }
+    if (num_sites == MAX_SITES)
+    {
+        current_site = 0;
+        return;
+    }
+    memset(&sites[num_sites], 0, sizeof(site_stats_t));
+    sites[num_sites].name = site;
+    current_site = num_sites++;
+}
+
+/*Bytes the file system was asked to write, the base of the write amplification*/
+void disk_stats_logical(unsigned long bytes)
+{
+    logical_bytes += bytes;
+}
+
+void disk_stats_reset()
+{
+    int i;
+
+    for (i = 0; i < num_sites; i++)
+    {
+        memset(sites[i].ops, 0, sizeof(sites[i].ops));
+        memset(sites[i].bytes, 0, sizeof(sites[i].bytes));
+        memset(sites[i].total_us, 0, sizeof(sites[i].total_us));
+        memset(sites[i].histogram, 0, sizeof(sites[i].histogram));
+    }
+    logical_bytes = 0;
+}
+
+static double stats_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3 + (model.simulated ? clock_us : 0.0);
+}
+
+/*op is DISK_OP_READ or DISK_OP_WRITE, begin a stats_clock reading taken when the transfer started*/
+static void stats_record(int op, int nblocks, double begin)
+{
+    site_stats_t *site = &sites[current_site];
+    double us = stats_clock() - begin;
+    int bucket = 0;
+
+    while (bucket < DISK_STATS_BUCKETS - 1 && us >= (double)(1UL << bucket))
+        bucket++;
+    site->ops[op]++;
+    site->bytes[op] += (unsigned long long)nblocks * BLOCK_SIZE;
+    site->total_us[op] += us;
+    site->histogram[op][bucket]++;
+}
+
+/*Physical bytes written per byte handed to disk_stats_logical, 0 before any*/
+double disk_stats_write_amplification()
+{
+    unsigned long long written = 0;
+    int i;
+
+    for (i = 0; i < num_sites; i++)
+        written += sites[i].bytes[DISK_OP_WRITE];
+    return logical_bytes ? (double)written / logical_bytes : 0.0;
+}
+
+static void stats_json_direction(FILE *out, const site_stats_t *site, int op)
+{
+    int i;
+
+    fprintf(out, "{\"ops\": %lu, \"bytes\": %llu, \"total_us\": %.1f, \"histogram\": [",
+            site->ops[op], site->bytes[op], site->total_us[op]);
+    for (i = 0; i < DISK_STATS_BUCKETS; i++)
+        fprintf(out, "%s%lu", i ? ", " : "", site->histogram[op][i]);
+    fprintf(out, "]}");
+}
+
+/*Writes the statistics as one JSON object. Returns 0, or -1 if out failed.*/
+int disk_stats_json(FILE *out)
+{
+    int i;
+
+    fprintf(out, "{\n  \"block_size\": %d,\n  \"histogram_upper_us\": [", BLOCK_SIZE);
+    for (i = 0; i < DISK_STATS_BUCKETS - 1; i++)
+        fprintf(out, "%s%lu", i ? ", " : "", 1UL << i);
+    fprintf(out, ", null],\n  \"sites\": [");
+    for (i = 0; i < num_sites; i++)
+    {
+        fprintf(out, "%s\n    {\"site\": \"%s\", \"read\": ", i ? "," : "", sites[i].name);
+        stats_json_direction(out, &sites[i], DISK_OP_READ);
+        fprintf(out, ",\n     \"write\": ");
+        stats_json_direction(out, &sites[i], DISK_OP_WRITE);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ],\n  \"logical_bytes_written\": %llu,\n  \"write_amplification\": %.3f\n}\n",
+            logical_bytes, disk_stats_write_amplification());
+    return ferror(out) ? -1 : 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Striped backend. Block b lives in member (b / stripe) % n, at block */
+/*(b / (stripe * n)) * stripe + b % stripe of that member's image. A  */
+/*transfer is cut at stripe unit boundaries into one iovec list per  */
+/*member, and the members that have work run their lists in parallel */
+/*on their own threads.                                              */
+/*-------------------------------------------------------------------*/
+#define MAX_MEMBERS 16
+
+typedef struct member {
+    int fd;
+    pthread_t thread;
+    int write;
+    off_t offset;
+    size_t length;
+    int niov;
+    struct iovec iov[IOV_MAX];
+    int result;
+    unsigned long syscalls;
+} member_t;
+
+static member_t members[MAX_MEMBERS];
+static int num_members = 0, stripe_blocks = 1, stripe_threads = 0;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t stripe_done = PTHREAD_COND_INITIALIZER;
+static unsigned long stripe_round = 0;
+static int stripe_busy = 0, stripe_quit = 0;
+
+/*Runs a member's iovec list with as few positional calls as it takes*/
+static int member_run(member_t *m)
+{
+    struct iovec *iov = m->iov;
+    int niov = m->niov;
+    off_t offset = m->offset;
+    ssize_t n;
+
+    while (niov > 0)
+    {
+        if (m->write)
+            n = pwritev(m->fd, iov, niov, offset);
+        else
+            n = preadv(m->fd, iov, niov, offset);
+        m->syscalls++;
+        if (n <= 0)
+            return -1;
+        offset += n;
+        while (niov > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void *member_thread(void *arg)
+{
+    member_t *m = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&stripe_lock);
+    while (1)
+    {
+        while (!stripe_quit && stripe_round == seen)
+            pthread_cond_wait(&stripe_work, &stripe_lock);
+        if (stripe_quit)
+            break;
+        seen = stripe_round;
+        if (m->niov == 0)
+            continue;
+
+        pthread_mutex_unlock(&stripe_lock);
+        m->result = member_run(m);
+        pthread_mutex_lock(&stripe_lock);
+        m->niov = 0;
+        if (--stripe_busy == 0)
+            pthread_cond_signal(&stripe_done);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return NULL;
+}
+
+/*Runs every member's pending list, in parallel when more than one has work*/
+static int stripe_run()
+{
+    int i, busy = 0, failed = 0;
+
+    for (i = 0; i < num_members; i++)
+    {
+        if (members[i].niov > 0)
+            busy++;
+    }
+
+    if (busy == 1 || (busy > 1 && !stripe_threads))
+    {
+        /*Nothing to overlap with: stay on the caller's thread*/
+        for (i = 0; i < num_members; i++)
+        {
+            if (members[i].niov == 0)
+                continue;
+            members[i].result = member_run(&members[i]);
+            members[i].niov = 0;
+        }
+    }
+    else if (busy > 1)
+    {
+        pthread_mutex_lock(&stripe_lock);
+        stripe_busy = busy;
+        stripe_round++;
+        pthread_cond_broadcast(&stripe_work);
+        while (stripe_busy > 0)
+            pthread_cond_wait(&stripe_done, &stripe_lock);
+        pthread_mutex_unlock(&stripe_lock);
+    }
+
+    for (i = 0; i < num_members; i++)
+    {
+        disk_counters.syscalls += members[i].syscalls;
+        members[i].syscalls = 0;
+        if (members[i].result < 0)
+            failed = 1;
+        members[i].result = 0;
+        members[i].length = 0;
+    }
+    return failed ? -1 : 0;
+}
+
+/*Adds whole blocks that lie inside one stripe unit to their member's list*/
+static int stripe_add(int write, int block, char *buffer, size_t len)
+{
+    int unit = block / stripe_blocks;
+    member_t *m = &members[unit % num_members];
+    off_t offset = ((off_t)(unit / num_members) * stripe_blocks + block % stripe_blocks) * BLOCK_SIZE;
+    struct iovec *last;
+
+    /*A list must stay contiguous in its image*/
+    if (m->niov > 0 && (m->niov == IOV_MAX || m->write != write || m->offset + (off_t)m->length != offset))
+    {
+        if (stripe_run() < 0)
+            return -1;
+    }
+
+    if (m->niov == 0)
+    {
+        m->write = write;
+        m->offset = offset;
+    }
+    last = m->niov > 0 ? &m->iov[m->niov - 1] : NULL;
+    if (last != NULL && (char *)last->iov_base + last->iov_len == buffer)
+        last->iov_len += len;
+    else
+    {
+        m->iov[m->niov].iov_base = buffer;
+        m->iov[m->niov].iov_len = len;
+        m->niov++;
+    }
+    m->length += len;
+    return 0;
+}
+
+/*Moves whole blocks between the members and an iovec list*/
+static int stripe_transfer(int write, int start_address, const struct iovec *iov, int niov)
+{
+    int block = start_address, i;
+
+    for (i = 0; i < niov; i++)
+    {
+        char *buffer = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+
+        while (left > 0)
+        {
+            size_t len = (size_t)(stripe_blocks - block % stripe_blocks) * BLOCK_SIZE;
+            if (len > left)
+                len = left;
+            if (stripe_add(write, block, buffer, len) < 0)
+                return -1;
+            block += len / BLOCK_SIZE;
+            buffer += len;
+            left -= len;
+        }
+    }
+    if (stripe_run() < 0)
+        return -1;
+    return block - start_address;
+}
+
+static void stripe_close()
+{
+    int i;
+
+    if (stripe_threads)
+    {
+        pthread_mutex_lock(&stripe_lock);
+        stripe_quit = 1;
+        pthread_cond_broadcast(&stripe_work);
+        pthread_mutex_unlock(&stripe_lock);
+        for (i = 0; i < num_members; i++)
+            pthread_join(members[i].thread, NULL);
+        stripe_threads = 0;
+        stripe_quit = 0;
+    }
+    for (i = 0; i < num_members; i++)
+        close(members[i].fd);
+    num_members = 0;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
+    disk_async_close();
+    stripe_close();
+    if(NULL != disk_map)
+    {
+        munmap(disk_map, disk_map_len);
+        disk_map = NULL;
+    }
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
+    }
+    if(-1 != disk_fd)
+    {
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    if(NULL != bounce)
+    {
+        disk_free_buffer(bounce);
+        bounce = NULL;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Allocates a transfer buffer usable with every backend, including   */
+/*O_DIRECT. Every allocation is counted in disk_counters.allocations.*/
+/*-------------------------------------------------------------------*/
+void *disk_alloc_buffer(size_t size)
+{
+    void *buffer;
+
+    if (posix_memalign(&buffer, BUFFER_ALIGN, size ? size : 1) != 0)
+        return NULL;
+    disk_counters.allocations++;
+    return buffer;
+}
+
+void disk_free_buffer(void *buffer)
+{
+    free(buffer);
+}
+
+/*-----------------------------------------------------------*/
+/*Opens the disk file with the stream or descriptor backend, */
+/*or maps the whole image into memory for the mmap backend   */
+/*-----------------------------------------------------------*/
+static int open_disk(char *filename, int fresh)
+{
+    off_t size = (off_t)MAX_BLOCK * BLOCK_SIZE;
+    int file_fd = -1;
+    struct stat st;
+
+    if (backend == DISK_BACKEND_DIRECT)
+    {
+        file_fd = disk_fd = open(filename, O_DIRECT | (fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR), 0644);
+        if (disk_fd == -1 && errno == EINVAL)
+        {
+            /*tmpfs and friends refuse O_DIRECT*/
+            printf("O_DIRECT not supported for %s, using buffered I/O\n", filename);
+            backend = DISK_BACKEND_FD;
+        }
+        else if (disk_fd == -1)
+            return -1;
+        else
+            bounce = disk_alloc_buffer(BLOCK_SIZE);
+    }
+    if (backend == DISK_BACKEND_FD || backend == DISK_BACKEND_MMAP)
+        file_fd = disk_fd = open(filename, fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    else if (backend == DISK_BACKEND_STDIO && (fp = fopen (filename, fresh ? "w+b" : "r+b")) != NULL)
+        file_fd = fileno(fp);
+    if (file_fd == -1)
+        return -1;
+
+    /*A fresh image is created sparse: the file system hands back*/
+    /*zeros for every block that was never written               */
+    if (fresh && ftruncate(file_fd, size) == -1)
+        return -1;
+
+    if (backend != DISK_BACKEND_MMAP)
+        return 0;
+
+    /*Pages of the mapping past the end of the file fault with SIGBUS*/
+    if (fstat(disk_fd, &st) == -1 || st.st_size < size)
+    {
+        printf("%s is shorter than %d blocks\n", filename, MAX_BLOCK);
+        return -1;
+    }
+    disk_map_len = (size_t)size;
+    disk_map = mmap(NULL, disk_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (disk_map == MAP_FAILED)
+    {
+        disk_map = NULL;
+        return -1;
     }
     return 0;
 }
@@ -26,63 +621,46 @@ int close_disk()
 /*---------------------------------------*/
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+int init_fresh_disk_backend(char *filename, int block_size, int num_blocks, int disk_backend)
 {
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    close_disk();
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+    backend = disk_backend;
+
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
+    if (open_disk(filename, 1) == -1)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
     return 0;
 }
+
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    return init_fresh_disk_backend(filename, block_size, num_blocks, DISK_BACKEND_FD);
+}
+
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+int init_disk_backend(char *filename, int block_size, int num_blocks, int disk_backend)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    close_disk();
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+    backend = disk_backend;
+
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
 
-    if (fp == NULL)
+    /*Opens a file*/
+    if (open_disk(filename, 0) == -1)
     {
         printf("Could not open %s\n\n", filename);
         return -1;
@@ -90,87 +668,263 @@ int init_disk(char *filename, int block_size, int num_blocks)
     return 0;
 }
 
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    return init_disk_backend(filename, block_size, num_blocks, DISK_BACKEND_FD);
+}
+
 /*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
+/*Opens (or creates, when fresh) one image per file name and stripes */
+/*the disk across them, stripe blocks at a time                      */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+static int init_striped(char *filenames[], int num_images, int stripe, int block_size, int num_blocks, int fresh)
 {
-    int i, j, e, s;
-    e = 0;
-    s = 0;
+    int i, units;
+    off_t size;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    close_disk();
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+    backend = DISK_BACKEND_STRIPED;
+
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+
+    if (num_images < 1 || num_images > MAX_MEMBERS || stripe < 1)
     {
-        printf("out of bound error %d\n", start_address);
+        printf("Cannot stripe over %d images\n\n", num_images);
         return -1;
     }
+    stripe_blocks = stripe;
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Every member holds the same number of stripe units*/
+    units = (num_blocks + stripe - 1) / stripe;
+    size = (off_t)((units + num_images - 1) / num_images) * stripe * block_size;
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    for (i = 0; i < num_images; i++)
     {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
+        members[i].fd = open(filenames[i], fresh ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+        if (members[i].fd == -1 || (fresh && ftruncate(members[i].fd, size) == -1))
+        {
+            printf("Could not open %s\n\n", filenames[i]);
+            if (members[i].fd != -1)
+                close(members[i].fd);
+            close_disk();
+            return -1;
+        }
+        members[i].niov = 0;
+        members[i].length = 0;
+        members[i].result = 0;
+        members[i].syscalls = 0;
+        num_members++;
+    }
 
-       for (j = 0; j < BLOCK_SIZE; j++)
+    /*With a single member there is nothing to run in parallel*/
+    if (num_images > 1)
+    {
+        for (i = 0; i < num_images; i++)
+        {
+            if (pthread_create(&members[i].thread, NULL, member_thread, &members[i]) != 0)
+                break;
+        }
+        if (i < num_images)
         {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+            /*Run everything on the caller's thread instead*/
+            pthread_mutex_lock(&stripe_lock);
+            stripe_quit = 1;
+            pthread_cond_broadcast(&stripe_work);
+            pthread_mutex_unlock(&stripe_lock);
+            while (i-- > 0)
+                pthread_join(members[i].thread, NULL);
+            stripe_quit = 0;
         }
+        else
+            stripe_threads = 1;
     }
+    return 0;
+}
 
-    free(blockRead);
+int init_fresh_disk_striped(char *filenames[], int num_images, int stripe, int block_size, int num_blocks)
+{
+    return init_striped(filenames, num_images, stripe, block_size, num_blocks, 1);
+}
 
+int init_disk_striped(char *filenames[], int num_images, int stripe, int block_size, int num_blocks)
+{
+    return init_striped(filenames, num_images, stripe, block_size, num_blocks, 0);
+}
 
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+/*-------------------------------------------------------------------*/
+/*Transfers bytes at the given offset with pread/pwrite, retrying on */
+/*short transfers. No seek pointer is shared between callers.        */
+/*-------------------------------------------------------------------*/
+static int pread_full(void *buffer, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pread(disk_fd, buffer, len, offset);
+        disk_counters.syscalls++;
+        if (n <= 0)
+            return -1;
+        buffer = (char *)buffer + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
 }
 
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+static int pwrite_full(const void *buffer, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(disk_fd, buffer, len, offset);
+        disk_counters.syscalls++;
+        if (n <= 0)
+            return -1;
+        buffer = (const char *)buffer + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Moves blocks from the image into the buffer, the model is not applied*/
+/*-------------------------------------------------------------------*/
+static int transfer_in(int start_address, int nblocks, void *buffer)
 {
     int i, e, s;
     e = 0;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    /*Mapped images are read with a plain copy*/
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        memcpy(buffer, disk_map + (size_t)start_address * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    /*Striped images split the run over their members*/
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        struct iovec iov = { buffer, (size_t)nblocks * BLOCK_SIZE };
+        return stripe_transfer(0, start_address, &iov, 1);
+    }
+
+    /*One positional read covers the whole run of blocks*/
+    if (backend == DISK_BACKEND_FD || (backend == DISK_BACKEND_DIRECT && IS_ALIGNED(buffer)))
+    {
+        if (pread_full(buffer, (size_t)nblocks * BLOCK_SIZE, (off_t)start_address * BLOCK_SIZE) == -1)
+            return -1;
+        return nblocks;
+    }
+
+    /*Unaligned O_DIRECT reads go one block at a time through the bounce block*/
+    if (backend == DISK_BACKEND_DIRECT)
+    {
+        for (i = 0; i < nblocks; i++)
+        {
+            if (pread_full(bounce, BLOCK_SIZE, (off_t)(start_address + i) * BLOCK_SIZE) == -1)
+                return -1;
+            memcpy((char *)buffer + (size_t)i * BLOCK_SIZE, bounce, BLOCK_SIZE);
+        }
+        return nblocks;
+    }
+
+    /*Goto the data requested from the disk*/
+    fseek(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
+
+    /*Every block requested lands straight in the caller's buffer*/
+    s = fread(buffer, BLOCK_SIZE, nblocks, fp);
+    disk_counters.syscalls++;
+    if (s != nblocks)
+        e = -(nblocks - s);
+
+    /*If no failure return the number of blocks read, else return the negative number of failures*/
+    if (e == 0)
+        return s;
+    else
+        return e;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    double begin = stats_clock();
+    int e;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
     {
-        printf("out of bound error\n");
+        printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Pause until the latency duration is elapsed, give up on failed blocks*/
+    e = device_access(start_address, nblocks);
+    if (e < 0)
+        return e;
+
+    e = transfer_in(start_address, nblocks, buffer);
+    if (e >= 0)
+        stats_record(DISK_OP_READ, nblocks, begin);
+    return e;
+}
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
+/*-------------------------------------------------------------------*/
+/*Moves blocks from the buffer into the image, the model is not applied*/
+/*-------------------------------------------------------------------*/
+static int transfer_out(int start_address, int nblocks, void *buffer)
+{
+    int i, e, s;
+    e = 0;
+    s = 0;
+
+    /*Mapped images are written with a plain copy, made durable by sync_disk*/
+    if (backend == DISK_BACKEND_MMAP)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        memcpy(disk_map + (size_t)start_address * BLOCK_SIZE, buffer, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
 
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    /*Striped images split the run over their members*/
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        struct iovec iov = { buffer, (size_t)nblocks * BLOCK_SIZE };
+        return stripe_transfer(1, start_address, &iov, 1);
+    }
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+    /*One positional write covers the whole run of blocks*/
+    if (backend == DISK_BACKEND_FD || (backend == DISK_BACKEND_DIRECT && IS_ALIGNED(buffer)))
+    {
+        if (pwrite_full(buffer, (size_t)nblocks * BLOCK_SIZE, (off_t)start_address * BLOCK_SIZE) == -1)
+            return -1;
+        return nblocks;
+    }
+
+    /*Unaligned O_DIRECT writes go one block at a time through the bounce block*/
+    if (backend == DISK_BACKEND_DIRECT)
+    {
+        for (i = 0; i < nblocks; i++)
+        {
+            memcpy(bounce, (char *)buffer + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+            if (pwrite_full(bounce, BLOCK_SIZE, (off_t)(start_address + i) * BLOCK_SIZE) == -1)
+                return -1;
+        }
+        return nblocks;
     }
-    free(blockWrite);
+
+    /*Goto where the data is to be written on the disk*/
+    fseek(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
+
+    /*All blocks go into the stream in one call and stay buffered there*/
+    /*until sync_disk; fseek on the next access moves them to the file */
+    s = fwrite(buffer, BLOCK_SIZE, nblocks, fp);
+    disk_counters.syscalls++;
+    e = s - nblocks;
 
     /*If no failure return the number of blocks written, else return the negative number of failures*/
     if (e == 0)
@@ -178,3 +932,788 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     else
         return e;
 }
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    double begin = stats_clock();
+    int e;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*Pause until the latency duration is elapsed, give up on failed blocks*/
+    e = device_access(start_address, nblocks);
+    if (e < 0)
+        return e;
+
+    disk_counters.blocks_written += nblocks;
+    e = transfer_out(start_address, nblocks, buffer);
+    if (e >= 0)
+        stats_record(DISK_OP_WRITE, nblocks, begin);
+    return e;
+}
+
+/*Positional vector I/O needs a descriptor and, for O_DIRECT, aligned buffers*/
+static int can_vector(void *buffers[], int nblocks)
+{
+    int i;
+
+    if (backend == DISK_BACKEND_FD || backend == DISK_BACKEND_STRIPED)
+        return 1;
+    if (backend != DISK_BACKEND_DIRECT)
+        return 0;
+    for (i = 0; i < nblocks; i++)
+    {
+        if (!IS_ALIGNED(buffers[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/*-------------------------------------------------------------------*/
+/*Scatter/gather versions: block i of the run is read into (written  */
+/*from) buffers[i]. The descriptor backend issues one preadv/pwritev */
+/*per IOV_MAX blocks, the stream backend falls back to single blocks.*/
+/*-------------------------------------------------------------------*/
+int read_blocksv(int start_address, int nblocks, void *buffers[])
+{
+    struct iovec iov[IOV_MAX];
+    double begin = stats_clock();
+    int i, done, batch;
+
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    if (!can_vector(buffers, nblocks))
+    {
+        for (i = 0; i < nblocks; i++)
+        {
+            if (read_blocks(start_address + i, 1, buffers[i]) < 0)
+                return -1;
+        }
+        return nblocks;
+    }
+
+    /*Pause until the latency duration is elapsed, give up on failed blocks*/
+    if ((i = device_access(start_address, nblocks)) < 0)
+        return i;
+
+    for (done = 0; done < nblocks; done += batch)
+    {
+        batch = nblocks - done < IOV_MAX ? nblocks - done : IOV_MAX;
+        for (i = 0; i < batch; i++)
+        {
+            iov[i].iov_base = buffers[done + i];
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+        if (backend == DISK_BACKEND_STRIPED)
+        {
+            if (stripe_transfer(0, start_address + done, iov, batch) < 0)
+                return -1;
+            continue;
+        }
+        disk_counters.syscalls++;
+        if (preadv(disk_fd, iov, batch, (off_t)(start_address + done) * BLOCK_SIZE) != (ssize_t)batch * BLOCK_SIZE)
+            return -1;
+    }
+    stats_record(DISK_OP_READ, nblocks, begin);
+    return nblocks;
+}
+
+int write_blocksv(int start_address, int nblocks, void *buffers[])
+{
+    struct iovec iov[IOV_MAX];
+    double begin = stats_clock();
+    int i, done, batch;
+
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    if (!can_vector(buffers, nblocks))
+    {
+        for (i = 0; i < nblocks; i++)
+        {
+            if (write_blocks(start_address + i, 1, buffers[i]) < 0)
+                return -1;
+        }
+        return nblocks;
+    }
+
+    /*Pause until the latency duration is elapsed, give up on failed blocks*/
+    if ((i = device_access(start_address, nblocks)) < 0)
+        return i;
+
+    disk_counters.blocks_written += nblocks;
+    for (done = 0; done < nblocks; done += batch)
+    {
+        batch = nblocks - done < IOV_MAX ? nblocks - done : IOV_MAX;
+        for (i = 0; i < batch; i++)
+        {
+            iov[i].iov_base = buffers[done + i];
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+        if (backend == DISK_BACKEND_STRIPED)
+        {
+            if (stripe_transfer(1, start_address + done, iov, batch) < 0)
+                return -1;
+            continue;
+        }
+        disk_counters.syscalls++;
+        if (pwritev(disk_fd, iov, batch, (off_t)(start_address + done) * BLOCK_SIZE) != (ssize_t)batch * BLOCK_SIZE)
+            return -1;
+    }
+    stats_record(DISK_OP_WRITE, nblocks, begin);
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/*Returns a pointer to the block inside the mapped image, or NULL    */
+/*when the disk is not using the mmap backend or the block is out of */
+/*range. Writes through the pointer are made durable by sync_disk.   */
+/*-------------------------------------------------------------------*/
+void *disk_block_ptr(int block)
+{
+    if (backend != DISK_BACKEND_MMAP || block < 0 || block >= MAX_BLOCK)
+        return NULL;
+    return disk_map + (size_t)block * BLOCK_SIZE;
+}
+
+/*-------------------------------------------------------------------*/
+/*Forces everything written so far out to the image file             */
+/*-------------------------------------------------------------------*/
+int sync_disk()
+{
+    disk_counters.syscalls++;
+    disk_counters.flushes++;
+    if (backend == DISK_BACKEND_MMAP)
+        return msync(disk_map, disk_map_len, MS_SYNC);
+    if (backend == DISK_BACKEND_FD || backend == DISK_BACKEND_DIRECT)
+        return fsync(disk_fd);
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        int i, res = 0;
+
+        for (i = 0; i < num_members; i++)
+        {
+            if (fsync(members[i].fd) == -1)
+                res = -1;
+        }
+        return res;
+    }
+    if (NULL != fp)
+    {
+        if (fflush(fp) != 0)
+            return -1;
+        return fsync(fileno(fp));
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Asynchronous engine. Requests are handed to an io_uring instance   */
+/*when the descriptor backend is in use and the kernel supports it;  */
+/*otherwise disk_submit performs the transfer on the spot and parks  */
+/*the request on a completion list so callers see the same API.      */
+/*-------------------------------------------------------------------*/
+static int ring_fd = -1;
+static unsigned ring_entries, ring_inflight, ring_unsubmitted;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_len, cq_ring_len, sqes_len;
+
+static disk_request_t *sync_done_head = NULL, *sync_done_tail = NULL;
+static int async_depth = 0;
+
+/*Merged requests travel through the engine with these internal ops,*/
+/*their buffer then points at the iovec array of the merged_t       */
+#define DISK_OP_READV 2
+#define DISK_OP_WRITEV 3
+#define MAX_MERGE 64
+
+typedef struct merged {
+    disk_request_t req;         /*must stay first, the engine hands back &req*/
+    disk_request_t *members;    /*the queued requests it covers, chained by next*/
+    int niov;
+    struct iovec iov[MAX_MERGE];
+} merged_t;
+
+static int ring_setup(unsigned depth)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring_fd < 0)
+    {
+        ring_fd = -1;
+        return -1;
+    }
+    sq_ring = cq_ring = MAP_FAILED;
+
+    sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_ring_len > sq_ring_len)
+            sq_ring_len = cq_ring_len;
+        cq_ring_len = sq_ring_len;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else
+    {
+        cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto fail;
+
+    sq_head = (unsigned *)((char *)sq_ring + params.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+    ring_entries = params.sq_entries;
+    ring_inflight = 0;
+    ring_unsubmitted = 0;
+    return 0;
+
+fail:
+    /*the sqes are mapped last, so only the rings can be left over*/
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_len);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_len);
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+static void ring_teardown()
+{
+    if (ring_fd == -1)
+        return;
+    munmap(sqes, sqes_len);
+    if (cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_len);
+    munmap(sq_ring, sq_ring_len);
+    close(ring_fd);
+    ring_fd = -1;
+}
+
+/*Sets up the engine with room for queue_depth requests in flight*/
+int disk_async_init(int queue_depth)
+{
+    disk_async_close();
+    if (queue_depth < 1)
+        queue_depth = 1;
+    async_depth = queue_depth;
+
+    if ((backend == DISK_BACKEND_FD || backend == DISK_BACKEND_DIRECT) && ring_setup(queue_depth) == 0)
+        return DISK_ENGINE_IO_URING;
+    return DISK_ENGINE_SYNC;
+}
+
+/*Waits for everything in flight and releases the ring*/
+int disk_async_close()
+{
+    disk_request_t *done[64];
+
+    while (disk_inflight() > 0)
+        disk_reap(1, done, 64);
+    sync_done_head = sync_done_tail = NULL;
+    ring_teardown();
+    async_depth = 0;
+    return 0;
+}
+
+/*Number of submitted requests that have not been reaped yet*/
+int disk_inflight()
+{
+    int n = ring_fd != -1 ? ring_inflight : 0;
+    disk_request_t *req;
+
+    for (req = sync_done_head; req != NULL; req = req->next)
+        n++;
+    return n;
+}
+
+/*Completes a merged transfer that stopped after done bytes*/
+static int finish_merged(merged_t *m, size_t done)
+{
+    off_t offset = (off_t)m->req.start_address * BLOCK_SIZE;
+    int i, res;
+
+    for (i = 0; i < m->niov; i++)
+    {
+        size_t len = m->iov[i].iov_len;
+
+        if (done < len)
+        {
+            char *base = (char *)m->iov[i].iov_base + done;
+            if (m->req.op == DISK_OP_WRITEV)
+                res = pwrite_full(base, len - done, offset + done);
+            else
+                res = pread_full(base, len - done, offset + done);
+            if (res == -1)
+                return -1;
+            done = 0;
+        }
+        else
+            done -= len;
+        offset += len;
+    }
+    return m->req.nblocks;
+}
+
+static int merged_aligned(merged_t *m)
+{
+    int i;
+
+    for (i = 0; i < m->niov; i++)
+    {
+        if (!IS_ALIGNED(m->iov[i].iov_base))
+            return 0;
+    }
+    return 1;
+}
+
+/*Whether the ring can take the request, unaligned O_DIRECT needs the bounce block*/
+static int ring_can_take(disk_request_t *req)
+{
+    if (ring_fd == -1)
+        return 0;
+    if (backend != DISK_BACKEND_DIRECT)
+        return 1;
+    if (req->op == DISK_OP_READV || req->op == DISK_OP_WRITEV)
+        return merged_aligned((merged_t *)req);
+    return IS_ALIGNED(req->buffer);
+}
+
+/*Performs a request on the spot, the model is not applied*/
+static int transfer_request(disk_request_t *req)
+{
+    merged_t *m = (merged_t *)req;
+    disk_request_t *member;
+    ssize_t n;
+
+    if (req->op == DISK_OP_READ)
+        return transfer_in(req->start_address, req->nblocks, req->buffer);
+    if (req->op == DISK_OP_WRITE)
+        return transfer_out(req->start_address, req->nblocks, req->buffer);
+
+    if (backend == DISK_BACKEND_STRIPED)
+        return stripe_transfer(req->op == DISK_OP_WRITEV, req->start_address, m->iov, m->niov);
+
+    /*One vectored call covers the whole merged run*/
+    if (backend == DISK_BACKEND_FD || (backend == DISK_BACKEND_DIRECT && merged_aligned(m)))
+    {
+        disk_counters.syscalls++;
+        if (req->op == DISK_OP_WRITEV)
+            n = pwritev(disk_fd, m->iov, m->niov, (off_t)req->start_address * BLOCK_SIZE);
+        else
+            n = preadv(disk_fd, m->iov, m->niov, (off_t)req->start_address * BLOCK_SIZE);
+        if (n < 0)
+            return -1;
+        return finish_merged(m, n);
+    }
+
+    /*Other backends move each member on its own*/
+    for (member = m->members; member != NULL; member = member->next)
+    {
+        if (req->op == DISK_OP_WRITEV)
+            n = transfer_out(member->start_address, member->nblocks, member->buffer);
+        else
+            n = transfer_in(member->start_address, member->nblocks, member->buffer);
+        if (n < 0)
+            return -1;
+    }
+    return req->nblocks;
+}
+
+/*Queues a request. Returns 0, or -1 when the queue is already full.*/
+int disk_submit(disk_request_t *req)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    req->result = 0;
+    req->next = NULL;
+
+    if (req->start_address < 0 || req->start_address + req->nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", req->start_address);
+        return -1;
+    }
+
+    /*Unaligned O_DIRECT buffers need the bounce block, which only the sync path uses*/
+    if (!ring_can_take(req))
+    {
+        if (async_depth > 0 && disk_inflight() >= async_depth)
+            return -1;
+        /*The transfer happens now but the model still overlaps it with the rest of the queue*/
+        req->complete_us = device_charge(req->start_address, req->nblocks, &req->result);
+        if (req->result == 0)
+            req->result = transfer_request(req);
+        if (sync_done_tail)
+            sync_done_tail->next = req;
+        else
+            sync_done_head = req;
+        sync_done_tail = req;
+        return 0;
+    }
+
+    if (ring_inflight >= ring_entries)
+        return -1;
+
+    /*Injected failures complete right away without touching the ring*/
+    req->complete_us = device_charge(req->start_address, req->nblocks, &req->result);
+    if (req->result < 0)
+    {
+        if (sync_done_tail)
+            sync_done_tail->next = req;
+        else
+            sync_done_head = req;
+        sync_done_tail = req;
+        return 0;
+    }
+
+    tail = *sq_tail;
+    idx = tail & *sq_mask;
+    sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = disk_fd;
+    sqe->addr = (unsigned long)req->buffer;
+    if (req->op == DISK_OP_READV || req->op == DISK_OP_WRITEV)
+    {
+        sqe->opcode = req->op == DISK_OP_READV ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->len = ((merged_t *)req)->niov;
+    }
+    else
+    {
+        sqe->opcode = req->op == DISK_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->len = (unsigned)req->nblocks * BLOCK_SIZE;
+    }
+    sqe->off = (unsigned long long)req->start_address * BLOCK_SIZE;
+    sqe->user_data = (unsigned long)req;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring_inflight++;
+    ring_unsubmitted++;
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Collects at least min_complete finished requests (fewer if less are*/
+/*in flight) into done[], at most max. Each request's result holds   */
+/*the number of blocks transferred or -1.                            */
+/*-------------------------------------------------------------------*/
+int disk_reap(int min_complete, disk_request_t **done, int max)
+{
+    int n = 0;
+    unsigned head;
+
+    /*Requests done on the spot count as finished once their device time is up*/
+    while (n < max && sync_done_head != NULL && (n < min_complete || sync_done_head->complete_us <= clock_us))
+    {
+        wait_until(sync_done_head->complete_us);
+        done[n++] = sync_done_head;
+        sync_done_head = sync_done_head->next;
+    }
+    if (sync_done_head == NULL)
+        sync_done_tail = NULL;
+    if (ring_fd == -1)
+        return n;
+
+    if (min_complete > n + (int)ring_inflight)
+        min_complete = n + ring_inflight;
+    if (min_complete > max)
+        min_complete = max;
+
+    while (1)
+    {
+        head = *cq_head;
+        while (n < max && head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            disk_request_t *req = (disk_request_t *)(unsigned long)cqe->user_data;
+            size_t want = (size_t)req->nblocks * BLOCK_SIZE;
+            off_t offset = (off_t)req->start_address * BLOCK_SIZE;
+
+            /*Finish short transfers synchronously*/
+            if (cqe->res < 0)
+                req->result = -1;
+            else if ((size_t)cqe->res < want && (req->op == DISK_OP_READV || req->op == DISK_OP_WRITEV))
+                req->result = finish_merged((merged_t *)req, cqe->res);
+            else if ((size_t)cqe->res < want)
+            {
+                if (req->op == DISK_OP_READ)
+                    req->result = pread_full((char *)req->buffer + cqe->res, want - cqe->res, offset + cqe->res);
+                else
+                    req->result = pwrite_full((char *)req->buffer + cqe->res, want - cqe->res, offset + cqe->res);
+                req->result = req->result == -1 ? -1 : req->nblocks;
+            }
+            else
+                req->result = req->nblocks;
+
+            wait_until(req->complete_us);
+            done[n++] = req;
+            ring_inflight--;
+            head++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if (n >= min_complete && ring_unsubmitted == 0)
+            return n;
+
+        disk_counters.syscalls++;
+        if (syscall(__NR_io_uring_enter, ring_fd, ring_unsubmitted,
+                    n >= min_complete ? 0 : min_complete - n,
+                    n >= min_complete ? 0 : IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            return n > 0 ? n : -1;
+        ring_unsubmitted = 0;
+        if (n >= min_complete)
+            return n;
+    }
+}
+
+/*-------------------------------------------------------------------*/
+/*Request queue. disk_queue only links a request onto the pending    */
+/*list. disk_dispatch sorts the list in elevator order (upwards from */
+/*the head position, then wrapping round to the lowest block), folds */
+/*requests for adjacent blocks with the same op into one vectored    */
+/*transfer and runs everything to completion. The order of requests  */
+/*within one dispatch is not kept, so they must not overlap.         */
+/*-------------------------------------------------------------------*/
+static disk_request_t *pending_head = NULL, *pending_tail = NULL;
+static int pending_count = 0;
+static int scheduler = DISK_SCHED_ELEVATOR;
+static merged_t merged[MAX_QUEUE_DEPTH];
+static double dispatch_begin;
+
+void disk_set_scheduler(int new_scheduler)
+{
+    scheduler = new_scheduler;
+}
+
+/*Adds a request to the pending list. Returns 0, or -1 if it is out of bounds.*/
+int disk_queue(disk_request_t *req)
+{
+    req->next = NULL;
+    if (req->start_address < 0 || req->start_address + req->nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", req->start_address);
+        req->result = -1;
+        return -1;
+    }
+
+    if (pending_tail)
+        pending_tail->next = req;
+    else
+        pending_head = req;
+    pending_tail = req;
+    pending_count++;
+    disk_counters.requests++;
+    if (req->op == DISK_OP_WRITE)
+        disk_counters.blocks_written += req->nblocks;
+    return 0;
+}
+
+/*Blocks behind the head sort after everything in front of it*/
+static int elevator_key(const disk_request_t *req, int head)
+{
+    return req->start_address >= head ? req->start_address : req->start_address + MAX_BLOCK;
+}
+
+/*Stable merge sort of a request list by elevator key*/
+static disk_request_t *elevator_sort(disk_request_t *list, int head)
+{
+    disk_request_t sorted, *tail, *slow, *fast, *right;
+
+    if (list == NULL || list->next == NULL)
+        return list;
+
+    for (slow = list, fast = list->next; fast != NULL && fast->next != NULL; fast = fast->next->next)
+        slow = slow->next;
+    right = slow->next;
+    slow->next = NULL;
+    list = elevator_sort(list, head);
+    right = elevator_sort(right, head);
+
+    tail = &sorted;
+    while (list != NULL && right != NULL)
+    {
+        if (elevator_key(right, head) < elevator_key(list, head))
+        {
+            tail->next = right;
+            right = right->next;
+        }
+        else
+        {
+            tail->next = list;
+            list = list->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = list != NULL ? list : right;
+    return sorted.next;
+}
+
+/*Takes the head of the pending list and every request that continues it*/
+static void merge_pending(merged_t *m)
+{
+    disk_request_t *req = pending_head, *last;
+
+    m->members = req;
+    m->niov = 0;
+    m->req.op = req->op;
+    m->req.start_address = req->start_address;
+    m->req.nblocks = 0;
+    do
+    {
+        m->iov[m->niov].iov_base = req->buffer;
+        m->iov[m->niov].iov_len = (size_t)req->nblocks * BLOCK_SIZE;
+        m->niov++;
+        m->req.nblocks += req->nblocks;
+        last = req;
+        req = req->next;
+        pending_count--;
+    } while (scheduler == DISK_SCHED_ELEVATOR && req != NULL && m->niov < MAX_MERGE &&
+             req->op == m->req.op && req->start_address == m->req.start_address + m->req.nblocks);
+
+    last->next = NULL;
+    pending_head = req;
+    if (req == NULL)
+        pending_tail = NULL;
+
+    if (m->niov > 1)
+    {
+        m->req.op = m->req.op == DISK_OP_READ ? DISK_OP_READV : DISK_OP_WRITEV;
+        m->req.buffer = m->iov;
+    }
+    else
+        m->req.buffer = m->members->buffer;
+    disk_counters.dispatched++;
+}
+
+/*Hands the merged result back to every member, returns how many failed*/
+static int complete_merged(merged_t *m)
+{
+    disk_request_t *req;
+    int failed = 0;
+
+    for (req = m->members; req != NULL; req = req->next)
+    {
+        req->result = m->req.result < 0 ? -1 : req->nblocks;
+        req->complete_us = m->req.complete_us;
+        if (req->result < 0)
+            failed++;
+        else
+            stats_record(req->op, req->nblocks, dispatch_begin);
+    }
+    return failed;
+}
+
+/*Runs the pending list to completion. Returns the number of requests that failed.*/
+int disk_dispatch()
+{
+    disk_request_t *done[64];
+    int free_slots[MAX_QUEUE_DEPTH];
+    int num_free = 0, limit, failed = 0, outstanding, got, i;
+    merged_t *m;
+
+    /*Queued requests all count their latency from here*/
+    dispatch_begin = stats_clock();
+    if (scheduler == DISK_SCHED_ELEVATOR)
+    {
+        pending_head = elevator_sort(pending_head, head_position);
+        for (pending_tail = pending_head; pending_tail != NULL && pending_tail->next != NULL;)
+            pending_tail = pending_tail->next;
+    }
+
+    limit = async_depth > 0 && async_depth < MAX_QUEUE_DEPTH ? async_depth : MAX_QUEUE_DEPTH;
+    for (i = limit - 1; i >= 0; i--)
+        free_slots[num_free++] = i;
+    outstanding = pending_count;
+
+    while (num_free < limit || pending_head != NULL)
+    {
+        while (num_free > 0 && pending_head != NULL)
+        {
+            m = &merged[free_slots[--num_free]];
+            merge_pending(m);
+            if (disk_submit(&m->req) == 0)
+                continue;
+            m->req.result = -1;
+            failed += complete_merged(m);
+            outstanding -= m->niov;
+            free_slots[num_free++] = m - merged;
+        }
+        if (num_free == limit)
+            break;
+
+        got = disk_reap(1, done, 64);
+        if (got <= 0)
+        {
+            /*The engine gave up, nothing left can be trusted*/
+            pending_head = pending_tail = NULL;
+            pending_count = 0;
+            return failed + outstanding;
+        }
+        for (i = 0; i < got; i++)
+        {
+            m = (merged_t *)done[i];
+            failed += complete_merged(m);
+            outstanding -= m->niov;
+            free_slots[num_free++] = m - merged;
+        }
+    }
+    return failed;
+}
+
+/*-------------------------------------------------------------------*/
+/*Runs a batch of requests to completion through the request queue,  */
+/*keeping up to the queue depth in flight. Returns the number of     */
+/*requests that failed.                                              */
+/*-------------------------------------------------------------------*/
+int disk_run(disk_request_t *reqs, int n)
+{
+    int failed = 0, i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (disk_queue(&reqs[i]) < 0)
+            failed++;
+    }
+    return failed + disk_dispatch();
+}
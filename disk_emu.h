@@ -1,5 +1,88 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#define DISK_BACKEND_STDIO 0
+#define DISK_BACKEND_FD 1
+#define DISK_BACKEND_MMAP 2
+#define DISK_BACKEND_DIRECT 3
+#define DISK_BACKEND_STRIPED 4
+
+#define DISK_ENGINE_SYNC 0
+#define DISK_ENGINE_IO_URING 1
+
+#define DISK_OP_READ 0
+#define DISK_OP_WRITE 1
+
+#define DISK_SCHED_NOOP 0
+#define DISK_SCHED_ELEVATOR 1
+
+#define DISK_STATS_BUCKETS 24
+
+typedef struct disk_counters {
+    unsigned long allocations;
+    unsigned long syscalls;     /*reads, writes, io_uring_enter and flushes made on the image*/
+    unsigned long flushes;      /*fflush/fsync/msync calls*/
+    unsigned long requests;     /*requests handed to disk_queue*/
+    unsigned long dispatched;   /*transfers left after merging*/
+    unsigned long blocks_written; /*blocks handed to write_blocks, write_blocksv and disk_queue*/
+} disk_counters_t;
+
+extern disk_counters_t disk_counters;
+
+typedef struct disk_request {
+    int op;
+    int start_address;
+    int nblocks;
+    void *buffer;
+    int result;
+    double complete_us;
+    struct disk_request *next;
+} disk_request_t;
+
+typedef struct disk_model {
+    double op_latency_us;
+    double seek_us_per_block;
+    double bandwidth_mb_s;
+    int queue_depth;
+    double failure_prob;
+    int max_retry;
+    int simulated;
+} disk_model_t;
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
+int init_fresh_disk_backend(char *filename, int block_size, int num_blocks, int disk_backend);
+int init_disk_backend(char *filename, int block_size, int num_blocks, int disk_backend);
+int init_fresh_disk_striped(char *filenames[], int num_images, int stripe_blocks, int block_size, int num_blocks);
+int init_disk_striped(char *filenames[], int num_images, int stripe_blocks, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int read_blocksv(int start_address, int nblocks, void *buffers[]);
+int write_blocksv(int start_address, int nblocks, void *buffers[]);
+int sync_disk();
+void *disk_block_ptr(int block);
 int close_disk();
+void *disk_alloc_buffer(size_t size);
+void disk_free_buffer(void *buffer);
+
+void disk_set_model(const disk_model_t *new_model);
+void disk_get_model(disk_model_t *current);
+double disk_clock_us();
+void disk_reset_clock();
+
+int disk_async_init(int queue_depth);
+int disk_async_close();
+int disk_submit(disk_request_t *req);
+int disk_reap(int min_complete, disk_request_t **done, int max);
+int disk_inflight();
+int disk_run(disk_request_t *reqs, int n);
+
+void disk_set_scheduler(int scheduler);
+int disk_queue(disk_request_t *req);
+int disk_dispatch();
+
+void disk_stats_site(const char *site);
+void disk_stats_logical(unsigned long bytes);
+void disk_stats_reset();
+double disk_stats_write_amplification();
+int disk_stats_json(FILE *out);
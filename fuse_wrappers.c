@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
@@ -137,6 +138,58 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     return res;
 }
 
+static int fuse_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    
+    char filename[MAXFILENAME];
+    
+    strcpy(filename, path);
+    
+    fd = sfs_fopen(filename);
+    if (fd == -1) 
+        return -errno;
+    
+    res = sfs_fsync(fd);
+    sfs_fclose(fd);
+    if (res < 0)
+        return -EIO;
+    return 0;
+}
+
+static int fuse_fallocate(const char *path, int mode, off_t offset, off_t length,
+        struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    
+    char filename[MAXFILENAME];
+    
+    /* plain preallocation only, no hole punching or keeping the size */
+    if (mode)
+        return -EOPNOTSUPP;
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+    /* sfs_fallocate takes ints, a range past INT_MAX would wrap */
+    if (length > INT_MAX || offset > INT_MAX - length)
+        return -EFBIG;
+    
+    strcpy(filename, path);
+    
+    fd = sfs_fopen(filename);
+    if (fd == -1) 
+        return -errno;
+    
+    res = sfs_fallocate(fd, (int) offset, (int) length);
+    sfs_fclose(fd);
+    if (res == -2)
+        return -ENOSPC;
+    if (res < 0)
+        return -EINVAL;
+    return 0;
+}
+
 static int fuse_truncate(const char *path, off_t size)
 {
     char filename[MAXFILENAME];
@@ -185,12 +238,21 @@ static struct fuse_operations xmp_oper = {
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .fsync = fuse_fsync,
+    .fallocate = fuse_fallocate,
     .access = fuse_access,
     .create = fuse_create,
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    //mounts the image left by the last run, a new one is only made when there is none;
+    //an image that is there but does not mount is left alone rather than formatted over
+    int res = mksfs(0);
+    if (res == -1) res = mksfs(1);
+    if (res < 0) {
+        fprintf(stderr, res == -2 ? "Refusing to mount or format the existing image\n" : "Cannot mount the file system\n");
+        return 1;
+    }
     return fuse_main(argc, argv, &xmp_oper, NULL);
 }
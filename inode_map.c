@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+#include "inode_map.h"
+
+/*-------------------------------------------------------------------*/
+/*Inode allocation map: one bit per inode, set while it is in use,   */
+/*in groups of IMAP_GROUP inodes that each keep a count of the free  */
+/*ones. A search starts at the word the last one took an inode from  */
+/*and skips whole groups on their count, so creating a file costs    */
+/*about the same with a million inodes as with ten. Freed inodes are */
+/*handed out again once the search has gone round to them.           */
+/*-------------------------------------------------------------------*/
+
+#define GROUP_WORDS (IMAP_GROUP / 64)
+
+static unsigned long long *words;
+static unsigned int *group_free;
+static unsigned int num_inodes, num_groups, free_total, hint;
+
+//every inode free, except 0 which is the root and the bits past num_inodes
+int imap_init(unsigned int count) {
+    imap_close();
+    num_inodes = count;
+    num_groups = (count + IMAP_GROUP - 1) / IMAP_GROUP;
+    words = calloc(num_groups * GROUP_WORDS, sizeof(*words));
+    group_free = calloc(num_groups, sizeof(*group_free));
+    if (!words || !group_free) {
+        imap_close();
+        return -1;
+    }
+    words[0] = 1;
+    imap_loaded();
+    return 0;
+}
+
+void imap_close() {
+    free(words);
+    free(group_free);
+    words = NULL;
+    group_free = NULL;
+    num_inodes = num_groups = free_total = hint = 0;
+}
+
+//takes the next free inode after the last one taken, 0 when there are none left
+unsigned int imap_alloc() {
+    unsigned int first = hint / GROUP_WORDS;
+
+    if (!free_total) return 0;
+    //the group of the hint comes up twice: from the hint on, then once round, from its start
+    for (unsigned int n = 0; n <= num_groups; n++) {
+        unsigned int group = (first + n) % num_groups;
+        if (!group_free[group]) continue;
+
+        unsigned int w = n ? group * GROUP_WORDS : hint;
+        for (; w < (group + 1) * GROUP_WORDS; w++) {
+            if (words[w] == ~0ULL) continue;
+            unsigned int bit = __builtin_ctzll(~words[w]);
+            words[w] |= 1ULL << bit;
+            group_free[group]--;
+            free_total--;
+            hint = w;
+            return w * 64 + bit;
+        }
+    }
+    return 0;
+}
+
+void imap_set(unsigned int inode, int used) {
+    unsigned long long bit = 1ULL << (inode % 64);
+
+    if (inode >= num_inodes || !(words[inode / 64] & bit) == !used) return;
+    words[inode / 64] ^= bit;
+    group_free[inode / IMAP_GROUP] += used ? -1 : 1;
+    free_total += used ? -1 : 1;
+}
+
+int imap_used(unsigned int inode) {
+    return inode >= num_inodes || (words[inode / 64] >> (inode % 64) & 1);
+}
+
+unsigned int imap_free_count() {
+    return free_total;
+}
+
+//the map as stored on disk, IMAP_BYTES(num_inodes) long
+void *imap_words() {
+    return words;
+}
+
+//recomputes the group counts, for when the words were read from disk
+void imap_loaded() {
+    free_total = 0;
+    for (unsigned int i = num_inodes; i < num_groups * IMAP_GROUP; i++) {
+        words[i / 64] |= 1ULL << (i % 64);
+    }
+    for (unsigned int g = 0; g < num_groups; g++) {
+        group_free[g] = 0;
+        for (unsigned int w = g * GROUP_WORDS; w < (g + 1) * GROUP_WORDS; w++) {
+            group_free[g] += 64 - __builtin_popcountll(words[w]);
+        }
+        free_total += group_free[g];
+    }
+    hint = 0;
+}
@@ -0,0 +1,13 @@
+#define IMAP_GROUP 4096 //inodes per group, one 512 byte block of the map
+
+//bytes of map for num_inodes, whole groups
+#define IMAP_BYTES(num_inodes) (((num_inodes) + IMAP_GROUP - 1) / IMAP_GROUP * (IMAP_GROUP / 8))
+
+int imap_init(unsigned int num_inodes);
+void imap_close();
+unsigned int imap_alloc();
+void imap_set(unsigned int inode, int used);
+int imap_used(unsigned int inode);
+unsigned int imap_free_count();
+void *imap_words();
+void imap_loaded();
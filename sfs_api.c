@@ -1,159 +1,633 @@
 #include "sfs_api.h"
 #include "disk_emu.h"
+#include "block_cache.h"
+#include "compress.h"
+#include "inode_map.h"
+#include "dir_index.h"
 #include <strings.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #define DISK_FILE "sfs_disk.disk"
-#define BLOCK_SIZE 512
-#define MAX_BLOCKS 100
-
-#define MAX_INODES 5
-#define MAX_FILES MAX_INODES
+#define SFS_MAGIC 1234
+#define DISK_BACKEND DISK_BACKEND_FD //or DISK_BACKEND_MMAP when the image fits in memory
+#define DISK_MEMBERS 1 //more than one stripes the disk over DISK_FILE.0, DISK_FILE.1, ...
+#define STRIPE_BLOCKS 8
+
+//geometry of the next mksfs(1) unless sfs_set_geometry picks another
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_BLOCKS 100
+#define DEFAULT_INODES 5
+
+//geometry of the file system in use, from its superblock
+#define BLOCK_SIZE ((int) sb.block_size)
+#define MAX_BLOCKS sb.num_blocks
+#define MAX_INODES sb.inode_table_len
+
+#define FD_TABLE_MIN 16 //handles to start with, the table doubles when they run out
+#define QUEUE_DEPTH 32
+#define CACHE_BUDGET (64 * BLOCK_SIZE)
+
+//compressed files are stored in clusters of this many logical blocks
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_BYTES (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define COMPRESS_NEW_FILES 0 //1 compresses every file created from here on
+
+//sequential readers get the next blocks fetched ahead, the window doubles on every sequential read
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 8
+
+//blocks written past the mapped part of a file wait in memory, up to this many per open file,
+//and get their disk blocks together when the file is flushed
+#define DELAY_BLOCKS 64
+
+//extents per leaf and entries per index node of the extent tree, nodes kept in memory,
+//and the most blocks mapped for one transfer
+#define LEAF_EXTENTS ((BLOCK_SIZE - sizeof(tree_node_t)) / sizeof(extent_t))
+#define INDEX_ENTRIES ((BLOCK_SIZE - sizeof(tree_node_t)) / sizeof(index_entry_t))
+#define NODE_CACHE 32
+#define MAP_BATCH 64
+
+//on disk, after the superblock: the inode table, whole inodes in each block, then the directory,
+//then data; the inode map, the checksum table and the free block map take the last blocks
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode_t))
+#define DIR_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry_t))
+#define DIR_SLOTS (sb.dir_len * DIR_PER_BLOCK)
+
+//free block map: one bit per block, set when the block is used
+#define MAP_WORDS ((MAX_BLOCKS + 63) / 64)
+#define SUMMARY_WORDS ((MAP_WORDS + 63) / 64)
 
 super_block_t sb;
-dir_entry_t root_dir[MAX_INODES];
+unsigned int format_block_size = DEFAULT_BLOCK_SIZE, format_blocks = DEFAULT_BLOCKS, format_inodes = DEFAULT_INODES;
+dir_entry_t *root_dir = NULL; //directory entries, placed by the hash of their name
+
+inode_t *inode_table = NULL;
+unsigned char *inode_pages = NULL; //1 for each block of the table read in, the others are only on disk
+fd_table_t *fd_table = NULL;
+int fd_capacity = 0;
+int *fd_free = NULL; //stack of the closed handles
+int fd_free_top = 0;
+int *open_fd = NULL; //handle + 1 of each open inode, 0 while it is closed
+
+unsigned long long *block_map = NULL;
+unsigned long long *map_summary = NULL; //bit w set when block_map[w] is full
+unsigned int map_hint = 0; //word the last search stopped at
+unsigned int free_blocks = 0;
+unsigned int delayed_blocks = 0; //claimed by delay buffers, counted as taken
+unsigned int *block_csums = NULL; //CRC32C of every block
+//a flag for each block of a table, set when it changes and cleared when sync_sfs writes it back
+unsigned char *inode_dirty = NULL, *dir_dirty = NULL, *map_dirty = NULL, *imap_dirty = NULL;
+char *block_buffer = NULL; //for metadata that does not fill its last block
+int read_ahead_max = READ_AHEAD_MAX;
+int delay_max = DELAY_BLOCKS;
+
+//extent tree nodes, so that a lookup costs one search of this table per level
+struct {
+    unsigned int block; //0 while the slot is empty
+    unsigned int last_use;
+    int pinned;         //held by the tree operation in progress
+} node_cache[NODE_CACHE];
+char *node_data = NULL; //a block for each slot
+unsigned int node_clock = 0;
+
+//the leaf a lookup ended in and the index entries it followed on the way down
+typedef struct tree_path {
+    tree_node_t *nodes[MAX_TREE_DEPTH]; //by level, the leaf at 0
+    int slots[MAX_TREE_DEPTH];
+    unsigned int limit; //where the next leaf takes over, 0 after the last one
+} tree_path_t;
+
+//last cluster decompressed, so that small reads in a row do not decompress it each time
+struct {
+    unsigned int inode_idx, cluster;
+    char *data;
+} cluster_cache;
+char *cluster_packed = NULL; //a cluster as compressed
+
+
+//takes the inode out of the map, so it is in use from here on
+unsigned int get_free_inode() {
+    unsigned int inode = imap_alloc();
+    if (inode) imap_dirty[inode / 8 / BLOCK_SIZE] = 1;
+    return inode; //UNAVAILABLE_INODE once they are all taken
+}
 
-inode_t inode_table[MAX_INODES];
-fd_table_t fd_table[MAX_FILES];
+void set_inode(unsigned int inode, int used) {
+    imap_set(inode, used);
+    imap_dirty[inode / 8 / BLOCK_SIZE] = 1;
+}
 
-unsigned short all_blocks[MAX_BLOCKS];
+//doubles the table, the new handles go on the stack so that the lowest comes off first
+int grow_fd_table() {
+    int capacity = fd_capacity ? 2 * fd_capacity : FD_TABLE_MIN;
+    fd_table_t *table = realloc(fd_table, capacity * sizeof(fd_table_t));
+    if (!table) return -1;
+    fd_table = table;
+    int *stack = realloc(fd_free, capacity * sizeof(int));
+    if (!stack) return -1;
+    fd_free = stack;
+
+    bzero(&fd_table[fd_capacity], (capacity - fd_capacity) * sizeof(fd_table_t));
+    for (int i = capacity - 1; i >= fd_capacity; i--) {
+        fd_free[fd_free_top++] = i;
+    }
+    fd_capacity = capacity;
+    return 0;
+}
 
+int get_free_filedescriptor() {
+    if (!fd_free_top && grow_fd_table() < 0) return -1;
+    return fd_free[--fd_free_top];
+}
 
-unsigned int get_free_inode() {
+int fd_is_open(int fileID) {
+    return fileID >= 0 && fileID < fd_capacity && fd_table[fileID].inode_idx;
+}
 
-    for (unsigned int i = FIRST_AVAILABLE_INODE; i < MAX_INODES; i++) {
-        if (inode_table[i].link_cnt == 0) {
-            return i;
-        }
+
+//lays out a file system of the given geometry, returns -1 when it leaves no block for data
+int init_superblock(super_block_t *s, unsigned int block_size, unsigned int num_blocks, unsigned int num_inodes) {
+    unsigned int inodes_per_block = block_size / sizeof(inode_t), dir_per_block = block_size / sizeof(dir_entry_t);
+
+    // init the superblock
+    bzero(s, sizeof(super_block_t));
+    s->magic = SFS_MAGIC;
+    s->block_size = block_size;
+    s->num_blocks = num_blocks;
+    s->fs_size = num_blocks * block_size; //wraps past 4 GB, num_blocks is what counts
+    s->inode_table_len = num_inodes;
+    s->root_dir_inode = ROOT_INODE;
+    s->inode_table_block = INODE_TABLE_BLOCK;
+    s->inode_table_blocks = (num_inodes + inodes_per_block - 1) / inodes_per_block;
+    s->dir_block = s->inode_table_block + s->inode_table_blocks;
+    s->dir_len = (num_inodes * 4 / 3 + dir_per_block) / dir_per_block; //a quarter left free keeps spills rare
+    s->free_map_len = ((num_blocks + 63) / 64 * sizeof(unsigned long long) + block_size - 1) / block_size;
+    s->free_map_block = num_blocks - s->free_map_len;
+    s->csum_table_len = ((unsigned long long) num_blocks * sizeof(unsigned int) + block_size - 1) / block_size;
+    s->csum_table_block = s->free_map_block - s->csum_table_len;
+    s->inode_map_len = (IMAP_BYTES(num_inodes) + block_size - 1) / block_size;
+    s->inode_map_block = s->csum_table_block - s->inode_map_len;
+
+    unsigned long long meta = (unsigned long long) s->dir_block + s->dir_len + s->inode_map_len +
+                              s->csum_table_len + s->free_map_len;
+    return meta < num_blocks ? 0 : -1;
+}
+
+//lays out the file system like init_superblock, returns -1 if the geometry is out of range
+int check_geometry(super_block_t *s, unsigned int block_size, unsigned int num_blocks, unsigned int num_inodes) {
+    if (block_size < 512 || block_size > 65536 || (block_size & (block_size - 1)) || !num_blocks || num_inodes < 2) {
+        return -1;
     }
-    return UNAVAILABLE_INODE;
+    return init_superblock(s, block_size, num_blocks, num_inodes);
 }
 
-int get_free_filedescriptor() {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!fd_table[i].inode_idx) {
-            return i;
-        }
+//takes effect with the next mksfs(1), returns -1 if the geometry is out of range
+int sfs_set_geometry(int block_size, int num_blocks, int num_inodes) {
+    super_block_t s;
 
+    if (num_blocks <= 0 || num_inodes < 2 || check_geometry(&s, block_size, num_blocks, num_inodes) < 0) {
+        fprintf(stderr, "Cannot make a file system of %d blocks of %d bytes with %d inodes\n",
+                num_blocks, block_size, num_inodes);
+        return -1;
     }
-    return -1;
+    format_block_size = block_size;
+    format_blocks = num_blocks;
+    format_inodes = num_inodes;
+    return 0;
 }
 
+//in-memory tables do not fill their last block, pad them before handing them to the cache
+void write_meta_block(unsigned int block, const void *data, size_t len) {
+    for (size_t done = 0; done < len; done += BLOCK_SIZE, block++) {
+        size_t part = len - done < BLOCK_SIZE ? len - done : BLOCK_SIZE;
+        memset(block_buffer, 0, BLOCK_SIZE);
+        memcpy(block_buffer, (const char *) data + done, part);
+        cache_write(block, block_buffer);
+    }
+}
 
-void init_superblock() {
+//reads len bytes from block on, MAP_BATCH blocks to a transfer
+int read_meta_block(unsigned int block, void *data, size_t len) {
+    unsigned int blocks[MAP_BATCH];
+    size_t batch = (size_t) MAP_BATCH * BLOCK_SIZE;
 
-    // init the superblock
-    sb.magic = 1234;
-    sb.block_size = BLOCK_SIZE;
-    sb.fs_size = MAX_BLOCKS * BLOCK_SIZE;
-    sb.inode_table_len = MAX_INODES;
-    sb.root_dir_inode = ROOT_INODE;
+    for (size_t done = 0; done < len; done += batch) {
+        size_t part = len - done < batch ? len - done : batch;
+        int n = (int) ((part + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        for (int i = 0; i < n; i++) blocks[i] = block++;
+        if (cache_read_bytes(blocks, n, 0, (int) part, (char *) data + done) < 0) return -1;
+    }
+    return 0;
+}
+
+//a table of count records of size bytes, as many whole records in each block as fit
+void write_records(unsigned int block, const void *data, size_t size, unsigned int count) {
+    unsigned int per_block = BLOCK_SIZE / size;
+    for (unsigned int i = 0; i < count; i += per_block, block++) {
+        unsigned int n = count - i < per_block ? count - i : per_block;
+        write_meta_block(block, (const char *) data + i * size, n * size);
+    }
+}
+
+//the reverse of write_records, a batch of blocks at a time
+int read_records(unsigned int block, void *data, size_t size, unsigned int count) {
+    unsigned int per_block = BLOCK_SIZE / size;
+    char *batch = malloc((size_t) MAP_BATCH * BLOCK_SIZE);
+    int res = batch ? 0 : -1;
+
+    for (unsigned int i = 0; i < count && !res; i += MAP_BATCH * per_block, block += MAP_BATCH) {
+        unsigned int n = count - i < MAP_BATCH * per_block ? count - i : MAP_BATCH * per_block;
+        res = read_meta_block(block, batch, (size_t) (n + per_block - 1) / per_block * BLOCK_SIZE);
+        for (unsigned int j = 0; j < n && !res; j += per_block) {
+            unsigned int part = n - j < per_block ? n - j : per_block;
+            memcpy((char *) data + (i + j) * size, batch + j / per_block * BLOCK_SIZE, part * size);
+        }
+    }
+    free(batch);
+    return res;
+}
+
+//the inode, its block of the table is read in the first time one of its inodes is needed;
+//NULL when that block cannot be read, and the block is tried again next time
+inode_t *get_inode(unsigned int inode_idx) {
+    unsigned int page = inode_idx / INODES_PER_BLOCK, first = page * INODES_PER_BLOCK;
+    unsigned int n = MAX_INODES - first < INODES_PER_BLOCK ? MAX_INODES - first : INODES_PER_BLOCK;
+
+    if (!inode_pages[page]) {
+        if (read_meta_block(sb.inode_table_block + page, &inode_table[first], n * sizeof(inode_t)) < 0) {
+            fprintf(stderr, "Failed to read inode table block %u\n", sb.inode_table_block + page);
+            return NULL;
+        }
+        inode_pages[page] = 1;
+    }
+    return &inode_table[inode_idx];
+}
+
+//the inode's block of the table goes out with the next sync_sfs
+void inode_changed(inode_t *inode) {
+    inode_dirty[(inode - inode_table) / INODES_PER_BLOCK] = 1;
 }
 
 void add_root_dir_inode() {
 
     //first entry in the inode table is the root
-    inode_table[0].mode = 0x755;
-    inode_table[0].link_cnt = 1;
-    inode_table[0].uid = 0;
-    inode_table[0].gid = 0;
-    inode_table[0].size = 45;
-    inode_table[0].data_ptrs[0] = DIRECTORY_TABLE_BLOCK; //root dir is stored in the 3rd block
+    inode_t *root = get_inode(ROOT_INODE);
+    root->mode = 0x755;
+    root->link_cnt = 1;
+    root->uid = 0;
+    root->gid = 0;
+    root->size = 45;
+    root->num_extents = 1;
+    root->extents[0].logical = 0;
+    root->extents[0].start = sb.dir_block; //root dir is stored right after the inode table
+    root->extents[0].len = sb.dir_len;
+    inode_changed(root);
 }
 
-void add_new_inode(int inode_index, unsigned int mode, unsigned int free_block) {
+void add_new_inode(int inode_index, unsigned int mode) {
 
     //second entry is the dummy file
-    inode_table[inode_index].mode = mode;
-    inode_table[inode_index].link_cnt = 1;
-    inode_table[inode_index].uid = 0;
-    inode_table[inode_index].gid = 0;
-    inode_table[inode_index].size = 0;
-    inode_table[inode_index].data_ptrs[0] = free_block; //dummy file data is stored in the 4th block
+    inode_t *inode = get_inode(inode_index);
+    inode->mode = mode;
+    inode->link_cnt = 1;
+    inode->uid = 0;
+    inode->gid = 0;
+    inode->size = 0;
+    inode->num_extents = 0; //blocks come with the first flush of written data
+    inode->indirect_ptr = UNAVAILABLE_BLOCK;
+    inode->depth = 0;
+    inode->flags = COMPRESS_NEW_FILES ? INODE_COMPRESSED : 0;
+    inode_changed(inode);
 }
 
-int get_unused_directory_spot() {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (!root_dir[i].inode_idx) {
-            return i;
-        }
-    }
-    return -1;
+//returns the entry's slot, 0 when the directory is full
+unsigned int add_new_file_dir_entry(unsigned int inode_index, char name[]) {
+    unsigned int slot = dir_insert(name, inode_index);
+    if (slot) dir_dirty[slot / DIR_PER_BLOCK] = 1;
+    return slot;
 }
 
-void add_new_file_dir_entry(unsigned int inode_index, char name[]) {
-    int idx = get_unused_directory_spot();
-    root_dir[idx].inode_idx = inode_index;
-    strcpy(root_dir[idx].name, name);
+//writes back the blocks of a table of count records marked in dirty, see write_records
+void write_dirty_records(unsigned int block, const void *data, size_t size, unsigned int count,
+                         unsigned char *dirty, unsigned int len) {
+    unsigned int per_block = BLOCK_SIZE / size;
+    for (unsigned int page = 0; page < len; page++) {
+        unsigned int first = page * per_block;
+        if (!dirty[page]) continue;
+        write_records(block + page, (const char *) data + first * size, size,
+                      count - first < per_block ? count - first : per_block);
+        dirty[page] = 0;
+    }
 }
 
+//hands the cache the metadata blocks that changed since the last call, in block order;
+//the next flush writes them back in one batch
 void sync_sfs() {
     printf("Writing inode table\n");
-    add_root_dir_inode();
-    write_blocks(INODE_TABLE_BLOCK, 1, &inode_table);
+    write_dirty_records(sb.inode_table_block, inode_table, sizeof(inode_t), MAX_INODES, inode_dirty,
+                        sb.inode_table_blocks);
 
-    // write root directory data to the 3rd block
+    // write root directory data after the inode table
     printf("Writing root dir\n");
 
-    write_blocks(DIRECTORY_TABLE_BLOCK, 1, &root_dir);
-    write_blocks(MAX_BLOCKS - 1, 1, &all_blocks);
+    write_dirty_records(sb.dir_block, root_dir, sizeof(dir_entry_t), DIR_SLOTS, dir_dirty, sb.dir_len);
+    write_dirty_records(sb.inode_map_block, imap_words(), 1, IMAP_BYTES(MAX_INODES), imap_dirty, sb.inode_map_len);
+    write_dirty_records(sb.free_map_block, block_map, 1, MAP_WORDS * sizeof(unsigned long long), map_dirty,
+                        sb.free_map_len);
+
+    //last, so that it covers everything written above
+    write_dirty_records(sb.csum_table_block, block_csums, sizeof(unsigned int), MAX_BLOCKS, cache_checksums_dirty(),
+                        sb.csum_table_len);
 }
 
 
-void zero_everything() {
+//opens the image, or all the striped members when there are several
+int open_sfs_disk(int fresh, unsigned int block_size, unsigned int num_blocks) {
+    if (DISK_MEMBERS == 1) {
+        if (fresh) return init_fresh_disk_backend(DISK_FILE, block_size, num_blocks, DISK_BACKEND);
+        return init_disk_backend(DISK_FILE, block_size, num_blocks, DISK_BACKEND);
+    }
+
+    char names[DISK_MEMBERS][sizeof(DISK_FILE) + 8];
+    char *members[DISK_MEMBERS];
+    for (int i = 0; i < DISK_MEMBERS; i++) {
+        snprintf(names[i], sizeof(names[i]), "%s.%d", DISK_FILE, i);
+        members[i] = names[i];
+    }
+    if (fresh) return init_fresh_disk_striped(members, DISK_MEMBERS, STRIPE_BLOCKS, block_size, num_blocks);
+    return init_disk_striped(members, DISK_MEMBERS, STRIPE_BLOCKS, block_size, num_blocks);
+}
+
+//reads the superblock of the image, -1 when there is no image, -2 when it cannot be read or holds no file system
+int read_superblock(super_block_t *s) {
+    super_block_t expected;
+    struct stat st;
+    char *block;
+    int res = -2;
+
+    //only a missing image is -1, an image that is there but fails to open must not be formatted over
+    if (stat(DISK_MEMBERS == 1 ? DISK_FILE : DISK_FILE ".0", &st) == -1 && errno == ENOENT) return -1;
+    block = disk_alloc_buffer(512);
+    //the superblock fits in the first 512 bytes whatever the block size
+    if (block && open_sfs_disk(0, 512, 1) == 0) {
+        res = read_blocks(SUPERBLOCK, 1, block) < 1 ? -2 : 0;
+        memcpy(s, block, sizeof(super_block_t));
+        close_disk();
+    }
+    disk_free_buffer(block);
+    if (res < 0) return res;
+    //every other field follows from the geometry, so a superblock that lays out differently is not ours
+    if (s->magic != SFS_MAGIC || check_geometry(&expected, s->block_size, s->num_blocks, s->inode_table_len) < 0 ||
+        memcmp(&expected, s, sizeof(super_block_t)) != 0) {
+        return -2;
+    }
+    return 0;
+}
+
+void set_block(unsigned int block, int used) {
+    unsigned int word = block / 64;
+
+    if (!(block_map[word] & 1ULL << (block % 64)) == !used) return;
+    map_dirty[word * sizeof(unsigned long long) / BLOCK_SIZE] = 1;
+    free_blocks += used ? -1 : 1;
+    if (used) block_map[word] |= 1ULL << (block % 64);
+    else block_map[word] &= ~(1ULL << (block % 64));
+    if (block_map[word] == ~0ULL) map_summary[word / 64] |= 1ULL << (word % 64);
+    else map_summary[word / 64] &= ~(1ULL << (word % 64));
+}
+
+//recomputes the summary from the map, for when the map is loaded from disk
+void build_map_summary() {
+    bzero(map_summary, SUMMARY_WORDS * sizeof(unsigned long long));
+    free_blocks = 0;
+    for (unsigned int w = 0; w < SUMMARY_WORDS * 64; w++) {
+        //words past the end of the map count as full so the search never lands there
+        if (w >= MAP_WORDS || block_map[w] == ~0ULL) map_summary[w / 64] |= 1ULL << (w % 64);
+        if (w < MAP_WORDS) free_blocks += 64 - __builtin_popcountll(block_map[w]);
+    }
+}
+
+//every block free except the bits past MAX_BLOCKS in the last word, which stay used
+void clear_block_map() {
+    bzero(block_map, MAP_WORDS * sizeof(unsigned long long));
+    for (unsigned int b = MAX_BLOCKS; b < MAP_WORDS * 64; b++) {
+        block_map[b / 64] |= 1ULL << (b % 64);
+    }
+    build_map_summary();
+    map_hint = 0;
+}
+
+int sync_everything() {
+    sync_sfs();
+    if (cache_flush() < 0) {
+        fprintf(stderr, "Failed to write back cached blocks\n");
+        return -1;
+    }
+    return sync_disk();
+}
 
-    bzero(&sb, sizeof(super_block_t));
-    bzero(&fd_table[0], sizeof(fd_table_t) * MAX_FILES);
-    bzero(&inode_table[0], sizeof(inode_t) * MAX_INODES);
-    bzero(&root_dir, sizeof(dir_entry_t));
-    bzero(&all_blocks[0], sizeof(unsigned int) * MAX_BLOCKS);
+//the in-memory tables, sized for the geometry in sb and zeroed
+int alloc_tables() {
+    free(inode_table);
+    free(inode_pages);
+    free(inode_dirty);
+    free(root_dir);
+    free(dir_dirty);
+    free(map_dirty);
+    free(imap_dirty);
+    free(block_map);
+    free(map_summary);
+    free(block_csums);
+    free(block_buffer);
+    free(node_data);
+    free(cluster_cache.data);
+    free(cluster_packed);
+
+    inode_table = calloc(MAX_INODES, sizeof(inode_t));
+    inode_pages = calloc(sb.inode_table_blocks, 1);
+    inode_dirty = calloc(sb.inode_table_blocks, 1);
+    root_dir = calloc(DIR_SLOTS, sizeof(dir_entry_t));
+    dir_dirty = calloc(sb.dir_len, 1);
+    map_dirty = calloc(sb.free_map_len, 1);
+    imap_dirty = calloc(sb.inode_map_len, 1);
+    block_map = calloc(MAP_WORDS, sizeof(unsigned long long));
+    map_summary = calloc(SUMMARY_WORDS, sizeof(unsigned long long));
+    block_csums = calloc(MAX_BLOCKS, sizeof(unsigned int));
+    block_buffer = malloc(BLOCK_SIZE);
+    node_data = malloc(NODE_CACHE * BLOCK_SIZE);
+    cluster_cache.data = malloc(CLUSTER_BYTES);
+    cluster_packed = malloc(CLUSTER_BYTES);
+    if (!inode_table || !inode_pages || !inode_dirty || !root_dir || !dir_dirty || !map_dirty || !imap_dirty ||
+        !block_map || !map_summary || !block_csums || !block_buffer ||
+        !node_data || !cluster_cache.data || !cluster_packed) {
+        fprintf(stderr, "Failed to allocate the tables for %u blocks and %u inodes\n", MAX_BLOCKS, MAX_INODES);
+        return -1;
+    }
+    return 0;
+}
+
+//closes every handle, what they still hold back is dropped
+int close_all_files() {
+    for (int i = 0; i < fd_capacity; i++) disk_free_buffer(fd_table[i].delay_data);
+    free(fd_table);
+    free(fd_free);
+    free(open_fd);
+    fd_table = NULL;
+    fd_free = NULL;
+    fd_capacity = fd_free_top = 0;
+    delayed_blocks = 0;
+    open_fd = calloc(MAX_INODES, sizeof(int));
+    return open_fd ? 0 : -1;
+}
+
+int zero_everything() {
+
+    if (close_all_files() < 0 || alloc_tables() < 0) return -1;
+    memset(inode_pages, 1, sb.inode_table_blocks); //nothing on disk yet
+    if (dir_init(root_dir, sb.dir_len, DIR_PER_BLOCK) < 0) {
+        fprintf(stderr, "Failed to allocate the directory index\n");
+        return -1;
+    }
+    clear_block_map();
+    if (imap_init(MAX_INODES) < 0) {
+        fprintf(stderr, "Failed to allocate the inode map\n");
+        return -1;
+    }
+    cluster_cache.inode_idx = UNAVAILABLE_INODE;
+    bzero(&node_cache, sizeof(node_cache));
+    return 0;
 
 }
 
-void mksfs(int fresh) {
+//mounts the file system on the image, the tables it needs first come in a few large reads
+int mount_sfs() {
+    super_block_t s;
+    unsigned int open_inodes = sb.magic == SFS_MAGIC ? MAX_INODES : 0;
+    int res = read_superblock(&s);
+
+    sb.magic = 0;
+    if (res < 0) {
+        fprintf(stderr, res == -1 ? "There is no %s\n" : "%s cannot be read or holds no file system\n", DISK_FILE);
+        return res;
+    }
+    sb = s;
+    //past this point the image is ours, so every failure is -2 and never reads as a missing image
+    //handles stay open across a remount as long as their inode numbers still mean the same
+    if ((open_inodes != MAX_INODES && close_all_files() < 0) || alloc_tables() < 0 ||
+        open_sfs_disk(0, BLOCK_SIZE, MAX_BLOCKS) < 0) {
+        sb.magic = 0;
+        return -2;
+    }
+    if (disk_async_init(QUEUE_DEPTH) < 0 || cache_init(BLOCK_SIZE, CACHE_BUDGET) < 0) {
+        sb.magic = 0;
+        return -2;
+    }
+    //every block read from here on is checked against the stored checksums,
+    //the table itself and the inode table are read a block at a time as they are needed
+    if (cache_set_checksums_lazy(block_csums, sb.csum_table_block, sb.csum_table_len, MAX_BLOCKS) < 0 ||
+        read_meta_block(sb.free_map_block, block_map, MAP_WORDS * sizeof(unsigned long long)) < 0 ||
+        imap_init(MAX_INODES) < 0 || read_meta_block(sb.inode_map_block, imap_words(), IMAP_BYTES(MAX_INODES)) < 0 ||
+        read_records(sb.dir_block, root_dir, sizeof(dir_entry_t), DIR_SLOTS) < 0 ||
+        dir_init(root_dir, sb.dir_len, DIR_PER_BLOCK) < 0) {
+        fprintf(stderr, "Failed to load the file system tables\n");
+        sb.magic = 0;
+        return -2;
+    }
+    imap_loaded();
+    build_map_summary();
+    map_hint = 0;
+    cluster_cache.inode_idx = UNAVAILABLE_INODE;
+    bzero(&node_cache, sizeof(node_cache));
+    return 0;
+}
+
+int flush_all_delayed();
+
+//mksfs(1) formats, mksfs(0) mounts the image already there: -1 when there is none,
+//-2 when there is one that cannot be mounted, which must not be formatted over, or when
+//the file system already mounted cannot let go of what its open files hold back
+int mksfs(int fresh) {
     //Implement mksfs here
+    disk_stats_site("mksfs");
     if (fresh == 1) {
 
         //begin
         printf("Initalizing sfs\n");
-        init_fresh_disk(DISK_FILE, BLOCK_SIZE, MAX_BLOCKS);
-        zero_everything();
+        cache_close();
+        init_superblock(&sb, format_block_size, format_blocks, format_inodes);
+        if (open_sfs_disk(1, BLOCK_SIZE, MAX_BLOCKS) < 0) {
+            sb.magic = 0;
+            return -1;
+        }
+        if (disk_async_init(QUEUE_DEPTH) < 0 || cache_init(BLOCK_SIZE, CACHE_BUDGET) < 0 || zero_everything() < 0) {
+            sb.magic = 0;
+            return -1;
+        }
+        if (cache_set_checksums(block_csums, sb.csum_table_block, sb.csum_table_len) < 0) {
+            fprintf(stderr, "Failed to allocate the checksum table flags\n");
+            sb.magic = 0;
+            return -1;
+        }
 
 
         // write superblock to the first block
         printf("Writing superblocks\n");
-        init_superblock();
-        write_blocks(0, 1, &sb);
+        write_meta_block(SUPERBLOCK, &sb, sizeof(sb));
 
 
-        // write the inode table to the 2nd block
+        // write the inode table from the 2nd block on
         printf("Writing inode table\n");
         add_root_dir_inode();
-        write_blocks(1, 1, &inode_table);
+        write_records(sb.inode_table_block, inode_table, sizeof(inode_t), MAX_INODES);
 
-        // write root directory data to the 3rd block
+        // write root directory data after it
         printf("Writing root dir\n");
-        write_blocks(2, 1, &root_dir);
+        write_records(sb.dir_block, root_dir, sizeof(dir_entry_t), DIR_SLOTS);
 
         //mark blocks as used
         printf("Writing free blocks\n");
-        all_blocks[SUPERBLOCK] = USED; //superblock
-        all_blocks[INODE_TABLE_BLOCK] = USED; //inode table
-        all_blocks[DIRECTORY_TABLE_BLOCK] = USED; //root dir data
-        all_blocks[MAX_BLOCKS - 1] = USED; //free blocks
+        set_block(SUPERBLOCK, USED); //superblock
+        for (unsigned int i = 0; i < sb.inode_table_blocks; i++) {
+            set_block(sb.inode_table_block + i, USED); //inode table
+        }
+        for (unsigned int i = 0; i < sb.dir_len; i++) {
+            set_block(sb.dir_block + i, USED); //root dir data
+        }
+        for (unsigned int i = 0; i < sb.free_map_len; i++) {
+            set_block(sb.free_map_block + i, USED); //free blocks
+        }
+        for (unsigned int i = 0; i < sb.csum_table_len; i++) {
+            set_block(sb.csum_table_block + i, USED); //checksums
+        }
+        for (unsigned int i = 0; i < sb.inode_map_len; i++) {
+            set_block(sb.inode_map_block + i, USED); //free inodes
+        }
 
-        // write the free blocks to the disk
-        write_blocks(MAX_BLOCKS - 1, 1, &all_blocks);
+        // write the free blocks and free inodes to the disk
+        write_meta_block(sb.free_map_block, block_map, MAP_WORDS * sizeof(unsigned long long));
+        write_meta_block(sb.inode_map_block, imap_words(), IMAP_BYTES(MAX_INODES));
+        return sync_everything() < 0 ? -1 : 0;
 
-    } else {
+    }
 
-        init_disk(DISK_FILE, BLOCK_SIZE, MAX_BLOCKS);
-        // pull back data from disk to mem
+    //files stay open across the remount, what they hold back goes out with the rest;
+    //what cannot be placed would be lost, so the file system then stays mounted as it is
+    if (sb.magic == SFS_MAGIC) {
+        if (flush_all_delayed() < 0) {
+            fprintf(stderr, "Cannot remount, held back blocks could not be placed\n");
+            return -2;
+        }
+        sync_sfs();
+        cache_close();
     }
+    // pull back data from disk to mem
+    return mount_sfs();
 }
 
 int sfs_getnextfilename(char *fname) {
@@ -162,73 +636,710 @@ int sfs_getnextfilename(char *fname) {
 
     printf("Calling sfs get next file\n");
 
-    for (int looper = 0; looper < MAX_FILES; looper++) {
-        current_file_ptr = (current_file_ptr + 1) % MAX_FILES;
+    //entries are spread by hash, so this walks every slot once and then reports the end
+    while (++current_file_ptr < DIR_SLOTS) {
         if (root_dir[current_file_ptr].inode_idx) {
-            strcpy(fname, root_dir[0].name);
+            strcpy(fname, root_dir[current_file_ptr].name);
             return 1;
         }
     }
-    current_file_ptr = 0; //No file in directory
+    current_file_ptr = 0; //end of the directory, the next call starts over
     return 0;
 }
 
 unsigned int get_directory_ptr_from_name(const char *name) {
-    for (unsigned int i = FIRST_AVAILABLE_INODE; i < MAX_INODES; i++) {
-        if (!root_dir[i].inode_idx) continue;
-        if (strcmp(root_dir[i].name, name) == 0) {
-            return i;
-        }
-    }
-    return UNAVAILABLE_INODE;
+    return dir_lookup(name); //UNAVAILABLE_INODE when there is no such file
 }
 
 int sfs_getfilesize(const char *path) {
 
     //Implement sfs_getfilesize here
+    disk_stats_site("sfs_getfilesize");
 
     int directory_ptr = get_directory_ptr_from_name(path);
     int unsigned inode_idx;
+    if (directory_ptr == UNAVAILABLE_INODE) return -1; //not the root inode's size
     inode_idx = root_dir[directory_ptr].inode_idx;
-    inode_t inode = inode_table[inode_idx];
-    return inode.size;
+    inode_t *inode = get_inode(inode_idx);
+    if (!inode) return -1;
+    return inode->size;
 }
 
 
 int check_if_file_open(int inode_idx) {
-    for (int i = 3; i < MAX_FILES; i++) {
-        if (root_dir[i].inode_idx == inode_idx) {
-            return i;
+    return open_fd[inode_idx] - 1; //-1 when it is not
+}
+
+//next fit: searches the summary from the word of the last allocation, wrapping round once
+unsigned int get_free_block() {
+    unsigned int first = map_hint / 64, from_bit = map_hint % 64;
+
+    for (unsigned int n = 0; n <= SUMMARY_WORDS; n++) {
+        unsigned int s = (first + n) % SUMMARY_WORDS;
+        unsigned long long open = ~map_summary[s];
+
+        if (n == 0) open &= ~0ULL << from_bit;
+        else if (n == SUMMARY_WORDS) open &= (1ULL << from_bit) - 1;
+        if (!open) continue;
+
+        unsigned int word = s * 64 + __builtin_ctzll(open);
+        map_hint = word;
+        return word * 64 + __builtin_ctzll(~block_map[word]);
+    }
+    return UNAVAILABLE_BLOCK;
+}
+
+//blocks nobody has a claim on, the ones held back for delay buffers excluded
+int count_free_blocks() {
+    return (int) free_blocks - (int) delayed_blocks;
+}
+
+//first word from word on with a free block, MAP_WORDS when there is none
+unsigned int next_open_word(unsigned int word) {
+    for (unsigned int s = word / 64; s < SUMMARY_WORDS; s++) {
+        unsigned long long open = ~map_summary[s];
+        if (s == word / 64) open &= ~0ULL << (word % 64);
+        if (open) return s * 64 + __builtin_ctzll(open);
+    }
+    return MAP_WORDS;
+}
+
+//next fit for want free blocks in a row, or the longest run there is when none is that long
+unsigned int get_free_run(unsigned int want, unsigned int *len) {
+    unsigned int best = UNAVAILABLE_BLOCK, best_len = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned int b = pass ? 0 : map_hint * 64, stop = pass ? map_hint * 64 : MAP_WORDS * 64;
+
+        while (b < stop) {
+            unsigned int word = next_open_word(b / 64);
+            if (word >= MAP_WORDS) break;
+            if (word > b / 64) b = word * 64;
+            unsigned long long open = ~block_map[word] & ~0ULL << (b % 64);
+            if (!open) {
+                b = (word + 1) * 64;
+                continue;
+            }
+
+            unsigned int start = word * 64 + __builtin_ctzll(open), end = start;
+            while (end < MAX_BLOCKS && end - start < want) {
+                unsigned long long used = block_map[end / 64] >> (end % 64);
+                if (used & 1) break;
+                end += used ? __builtin_ctzll(used) : 64 - end % 64;
+            }
+            if (end - start > want) end = start + want;
+            if (end - start > best_len) {
+                best = start;
+                best_len = end - start;
+            }
+            if (best_len == want) break;
+            b = end;
         }
+        if (best_len == want) break;
     }
-    return -1;
+    if (best_len) map_hint = (best + best_len - 1) / 64;
+    *len = best_len;
+    return best;
 }
 
-unsigned int get_free_block() {
-    for (unsigned int i = FIRST_AVAILABLE_BLOCK; i < MAX_BLOCKS; i++) {
-        if (all_blocks[i] == 0) {
-            return i;
+extent_t *node_extents(tree_node_t *node) {
+    return (extent_t *) (node + 1);
+}
+
+index_entry_t *node_index(tree_node_t *node) {
+    return (index_entry_t *) (node + 1);
+}
+
+int node_slot(tree_node_t *node) {
+    return (int) (((char *) node - node_data) / BLOCK_SIZE);
+}
+
+//least recently used slot nobody holds
+int node_victim() {
+    int victim = -1;
+    for (int i = 0; i < NODE_CACHE; i++) {
+        if (!node_cache[i].pinned && (victim < 0 || node_cache[i].last_use < node_cache[victim].last_use)) victim = i;
+    }
+    assert(victim >= 0); //an operation holds at most two nodes per level
+    return victim;
+}
+
+tree_node_t *hold_node(int slot, unsigned int block) {
+    node_cache[slot].block = block;
+    node_cache[slot].pinned = 1;
+    node_cache[slot].last_use = ++node_clock;
+    return (tree_node_t *) (node_data + slot * BLOCK_SIZE);
+}
+
+//the node stored in block, read through the block cache on a miss
+tree_node_t *get_node(unsigned int block, unsigned int level) {
+    int slot = -1;
+    for (int i = 0; i < NODE_CACHE; i++) {
+        if (node_cache[i].block == block) slot = i;
+    }
+    if (slot < 0) {
+        slot = node_victim();
+        node_cache[slot].block = 0;
+        if (read_meta_block(block, node_data + slot * BLOCK_SIZE, BLOCK_SIZE) < 0) {
+            fprintf(stderr, "Failed to read extent tree block %u\n", block);
+            return NULL;
         }
     }
-    return UNAVAILABLE_BLOCK;
+    tree_node_t *node = hold_node(slot, block);
+    if (node->level != level || node->count > (level ? INDEX_ENTRIES : LEAF_EXTENTS)) {
+        fprintf(stderr, "Extent tree block %u is corrupt\n", block);
+        node_cache[slot].block = 0;
+        return NULL;
+    }
+    return node;
+}
+
+//an empty node on a newly allocated block, the caller has made sure there is one
+tree_node_t *new_node(unsigned int level, unsigned int *block) {
+    *block = get_free_block();
+    set_block(*block, USED);
+    tree_node_t *node = hold_node(node_victim(), *block);
+    memset(node, 0, BLOCK_SIZE);
+    node->level = level;
+    return node;
+}
+
+void store_node(tree_node_t *node) {
+    write_meta_block(node_cache[node_slot(node)].block, node, BLOCK_SIZE);
+}
+
+void release_node(tree_node_t *node) {
+    node_cache[node_slot(node)].pinned = 0;
+}
+
+void release_nodes() {
+    for (int i = 0; i < NODE_CACHE; i++) node_cache[i].pinned = 0;
+}
+
+void forget_node(tree_node_t *node) {
+    node_cache[node_slot(node)].block = 0;
+    node_cache[node_slot(node)].pinned = 0;
+}
+
+//the entry to follow: the last one whose key is not past logical, the first when they all are
+int index_slot(tree_node_t *node, unsigned int logical) {
+    index_entry_t *index = node_index(node);
+    int lo = 1, hi = (int) node->count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (index[mid].logical <= logical) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+//walks down to the leaf that holds the extents around logical, one cached lookup per level
+tree_node_t *find_leaf(inode_t *inode, unsigned int logical, tree_path_t *path) {
+    unsigned int block = inode->indirect_ptr;
+
+    path->limit = 0;
+    for (int level = (int) inode->depth - 1;; level--) {
+        tree_node_t *node = get_node(block, (unsigned) level);
+        if (!node) return NULL;
+        path->nodes[level] = node;
+        if (!level) return node;
+
+        int slot = index_slot(node, logical);
+        path->slots[level] = slot;
+        //keys shrink going down, so the deepest one after our entry bounds the leaf
+        if (slot + 1 < (int) node->count) path->limit = node_index(node)[slot + 1].logical;
+        block = node_index(node)[slot].block;
+    }
+}
+
+//the extents to work on: the leaf for logical, or the ones in the inode while there is no tree
+int find_extents(inode_t *inode, unsigned int logical, tree_path_t *path, extent_t **list, unsigned int **count) {
+    path->limit = 0;
+    path->nodes[0] = NULL;
+    if (!inode->depth) {
+        *list = inode->extents;
+        *count = &inode->num_extents;
+        return INODE_EXTENTS;
+    }
+    tree_node_t *leaf = find_leaf(inode, logical, path);
+    if (!leaf) {
+        release_nodes();
+        return -1;
+    }
+    *list = node_extents(leaf);
+    *count = &leaf->count;
+    return LEAF_EXTENTS;
+}
+
+//splitting the leaf may take a new node on every level; the tree only grows up to MAX_TREE_DEPTH
+int room_to_split(inode_t *inode, tree_path_t *path) {
+    int full_levels = 1;
+    while (full_levels < (int) inode->depth && path->nodes[full_levels]->count == INDEX_ENTRIES) full_levels++;
+    if (full_levels == MAX_TREE_DEPTH) {
+        fprintf(stderr, "File needs more extents than a %d level tree holds\n", MAX_TREE_DEPTH);
+        return 0;
+    }
+    if (count_free_blocks() < full_levels + 1) {
+        fprintf(stderr, "Disk Full! No block left for the extent tree.\n");
+        return 0;
+    }
+    return 1;
+}
+
+//an extent's length without the unwritten flag
+unsigned int extent_len(const extent_t *extent) {
+    return extent->len & ~EXTENT_UNWRITTEN;
+}
+
+//disk blocks behind file blocks [first, first + num_blocks), 0 for holes and with
+//EXTENT_UNWRITTEN set for blocks that were reserved but never written
+int map_blocks(inode_t *inode, unsigned int first, int num_blocks, unsigned int *blocks) {
+    unsigned int end = first + num_blocks, *count;
+    extent_t *list;
+    tree_path_t path;
+
+    memset(blocks, 0, num_blocks * sizeof(unsigned int));
+    for (unsigned int pos = first;; pos = path.limit) {
+        if (find_extents(inode, pos, &path, &list, &count) < 0) return -1;
+        for (unsigned int i = 0; i < *count && list[i].logical < end; i++) {
+            unsigned int from = list[i].logical > first ? list[i].logical : first,
+                    to = list[i].logical + extent_len(&list[i]) < end ? list[i].logical + extent_len(&list[i]) : end;
+            for (unsigned int b = from; b < to; b++) {
+                blocks[b - first] = (list[i].start + b - list[i].logical) | (list[i].len & EXTENT_UNWRITTEN);
+            }
+        }
+        release_nodes();
+        if (!path.limit || path.limit >= end) return 0;
+    }
+}
+
+//true when the new blocks continue extent on disk as well as in the file and are in the same state
+int lines_up(const extent_t *extent, unsigned int logical, unsigned int start, unsigned int len) {
+    return (extent->len & EXTENT_UNWRITTEN) == (len & EXTENT_UNWRITTEN) &&
+           extent->logical + extent_len(extent) == logical && extent->start + extent_len(extent) == start;
+}
+
+//grows the extent before or after at when the new blocks line up with it, 0 when neither does
+int merge_extent(extent_t *list, unsigned int *count, int at, unsigned int logical, unsigned int start,
+                 unsigned int len) {
+    extent_t added = {logical, start, len};
+
+    if (at > 0 && lines_up(&list[at - 1], logical, start, len)) {
+        list[at - 1].len += extent_len(&added);
+        //the new blocks may also close the gap to the next extent
+        if (at < (int) *count && lines_up(&added, list[at].logical, list[at].start, list[at].len)) {
+            list[at - 1].len += extent_len(&list[at]);
+            memmove(&list[at], &list[at + 1], (*count - at - 1) * sizeof(extent_t));
+            (*count)--;
+        }
+        return 1;
+    }
+    if (at < (int) *count && lines_up(&added, list[at].logical, list[at].start, list[at].len)) {
+        list[at].logical = logical;
+        list[at].start = start;
+        list[at].len += extent_len(&added);
+        return 1;
+    }
+    return 0;
+}
+
+void insert_extent(extent_t *list, unsigned int *count, int at, unsigned int logical, unsigned int start,
+                   unsigned int len) {
+    memmove(&list[at + 1], &list[at], (*count - at) * sizeof(extent_t));
+    list[at].logical = logical;
+    list[at].start = start;
+    list[at].len = len;
+    (*count)++;
+}
+
+//hooks the node that split off at level - 1 into its parent, splitting the parents that are full too
+void insert_index(inode_t *inode, tree_path_t *path, int level, unsigned int key, unsigned int block) {
+    for (; level < (int) inode->depth; level++) {
+        tree_node_t *parent = path->nodes[level], *target = parent, *right = NULL;
+        int at = path->slots[level] + 1, keep;
+        unsigned int right_block = 0;
+
+        if (parent->count == INDEX_ENTRIES) {
+            //appends leave the full node as it is, anything else splits it in half
+            keep = at == (int) parent->count ? at : (int) INDEX_ENTRIES / 2;
+            right = new_node((unsigned) level, &right_block);
+            right->count = parent->count - keep;
+            memcpy(node_index(right), &node_index(parent)[keep], right->count * sizeof(index_entry_t));
+            parent->count = (unsigned) keep;
+            if (at >= keep) {
+                target = right;
+                at -= keep;
+            }
+        }
+        memmove(&node_index(target)[at + 1], &node_index(target)[at], (target->count - at) * sizeof(index_entry_t));
+        node_index(target)[at].logical = key;
+        node_index(target)[at].block = block;
+        target->count++;
+        store_node(parent);
+        if (!right) return;
+
+        store_node(right);
+        key = node_index(right)[0].logical;
+        block = right_block;
+    }
+
+    //the root split, a new one goes on top
+    unsigned int root_block;
+    tree_node_t *root = new_node(inode->depth, &root_block);
+    root->count = 2;
+    node_index(root)[0].logical = 0;
+    node_index(root)[0].block = inode->indirect_ptr;
+    node_index(root)[1].logical = key;
+    node_index(root)[1].block = block;
+    store_node(root);
+    inode->indirect_ptr = root_block;
+    inode->depth++;
+}
+
+//puts the new extent at at of a full leaf, or moves the inode's extents out to the first leaf
+int split_leaf(inode_t *inode, tree_path_t *path, int at, unsigned int logical, unsigned int start,
+               unsigned int len) {
+    tree_node_t *leaf = path->nodes[0], *right;
+    unsigned int right_block;
+    int keep;
+
+    if (!leaf) {
+        if (!count_free_blocks()) {
+            fprintf(stderr, "Disk Full! No block left for the extent tree.\n");
+            return -1;
+        }
+        right = new_node(0, &right_block);
+        right->count = inode->num_extents;
+        memcpy(node_extents(right), inode->extents, inode->num_extents * sizeof(extent_t));
+        insert_extent(node_extents(right), &right->count, at, logical, start, len);
+        store_node(right);
+        inode->indirect_ptr = right_block;
+        inode->depth = 1;
+        inode->num_extents = 0;
+        return 0;
+    }
+
+    if (!room_to_split(inode, path)) return -1;
+    //a file growing at its end fills its leaves, blocks going into the middle split one in half
+    keep = at == (int) leaf->count ? at : (int) LEAF_EXTENTS / 2;
+    right = new_node(0, &right_block);
+    right->count = leaf->count - keep;
+    memcpy(node_extents(right), &node_extents(leaf)[keep], right->count * sizeof(extent_t));
+    leaf->count = (unsigned) keep;
+    if (at < keep) insert_extent(node_extents(leaf), &leaf->count, at, logical, start, len);
+    else insert_extent(node_extents(right), &right->count, at - keep, logical, start, len);
+    store_node(leaf);
+    store_node(right);
+    insert_index(inode, path, 1, node_extents(right)[0].logical, right_block);
+    return 0;
+}
+
+//maps a hole to len blocks from start, growing a neighbouring extent when they line up;
+//len may carry EXTENT_UNWRITTEN
+int map_insert(inode_t *inode, unsigned int logical, unsigned int start, unsigned int len) {
+    extent_t *list;
+    unsigned int *count, unwritten = len & EXTENT_UNWRITTEN, blocks = len & ~EXTENT_UNWRITTEN;
+    tree_path_t path;
+    int capacity = find_extents(inode, logical, &path, &list, &count), at = 0, result = 0;
+
+    if (capacity < 0) return -1;
+    inode_changed(inode);
+    //a leaf only holds extents up to where the next one takes over
+    if (path.limit && logical + blocks > path.limit) {
+        unsigned int part = path.limit - logical;
+        release_nodes();
+        if (map_insert(inode, logical, start, part | unwritten) < 0) return -1;
+        return map_insert(inode, logical + part, start + part, (blocks - part) | unwritten);
+    }
+
+    while (at < (int) *count && list[at].logical < logical) at++;
+    if (merge_extent(list, count, at, logical, start, len)) {
+        if (path.nodes[0]) store_node(path.nodes[0]);
+    } else if ((int) *count < capacity) {
+        insert_extent(list, count, at, logical, start, len);
+        if (path.nodes[0]) store_node(path.nodes[0]);
+    } else {
+        result = split_leaf(inode, &path, at, logical, start, len);
+    }
+    release_nodes();
+    return result;
+}
+
+//unmaps file blocks [logical, logical + len), splitting the extents they cut through,
+//and frees their disk blocks unless they are about to be mapped again
+int map_punch(inode_t *inode, unsigned int logical, unsigned int len, int release) {
+    unsigned int end = logical + len, *count;
+    extent_t *list, tail = {0, 0, 0};
+    tree_path_t path;
+
+    inode_changed(inode);
+    for (unsigned int pos = logical;; pos = path.limit) {
+        int capacity = find_extents(inode, pos, &path, &list, &count);
+        if (capacity < 0) return -1;
+
+        for (unsigned int i = 0; i < *count && list[i].logical < end;) {
+            unsigned int ext_end = list[i].logical + extent_len(&list[i]), unwritten = list[i].len & EXTENT_UNWRITTEN,
+                    from = list[i].logical > logical ? list[i].logical : logical, to = ext_end < end ? ext_end : end;
+            if (ext_end <= logical) {
+                i++;
+                continue;
+            }
+            if (list[i].logical < logical && ext_end > end) {
+                //cut through the middle: the second half goes back in as an extent of its own
+                if ((int) *count == capacity && inode->depth && !room_to_split(inode, &path)) {
+                    release_nodes();
+                    return -1;
+                }
+                tail.logical = end;
+                tail.start = list[i].start + end - list[i].logical;
+                tail.len = (ext_end - end) | unwritten;
+            }
+            for (unsigned int b = from; release && b < to; b++) set_block(list[i].start + b - list[i].logical, FREE);
+            if (list[i].logical < logical) {
+                list[i].len = (logical - list[i].logical) | unwritten;
+                i++;
+            } else if (ext_end > end) {
+                list[i].start += end - list[i].logical;
+                list[i].len = (ext_end - end) | unwritten;
+                list[i].logical = end;
+                i++;
+            } else {
+                memmove(&list[i], &list[i + 1], (*count - i - 1) * sizeof(extent_t));
+                (*count)--;
+            }
+        }
+        if (path.nodes[0]) store_node(path.nodes[0]);
+        release_nodes();
+        if (tail.len) return map_insert(inode, tail.logical, tail.start, tail.len);
+        if (!path.limit || path.limit >= end) return 0;
+    }
+}
+
+//unwritten blocks [logical, logical + len) from start now hold data
+int map_written(inode_t *inode, unsigned int logical, unsigned int start, unsigned int len) {
+    if (map_punch(inode, logical, len, 0) < 0) return -1;
+    return map_insert(inode, logical, start, len);
+}
+
+//frees the blocks under a node and the node itself
+int free_node(unsigned int block, unsigned int level) {
+    tree_node_t *node = get_node(block, level);
+    int result = 0;
+
+    if (!node) return -1;
+    for (unsigned int i = 0; i < node->count; i++) {
+        if (level) {
+            if (free_node(node_index(node)[i].block, level - 1) < 0) result = -1;
+            continue;
+        }
+        for (unsigned int b = 0; b < extent_len(&node_extents(node)[i]); b++) {
+            set_block(node_extents(node)[i].start + b, FREE);
+        }
+    }
+    forget_node(node);
+    set_block(block, FREE);
+    return result;
+}
+
+//frees every block of the file, the extent tree included
+int free_extents(inode_t *inode) {
+    int result = 0;
+
+    if (inode->depth) {
+        result = free_node(inode->indirect_ptr, inode->depth - 1);
+    } else {
+        for (unsigned int i = 0; i < inode->num_extents; i++) {
+            for (unsigned int b = 0; b < extent_len(&inode->extents[i]); b++) set_block(inode->extents[i].start + b, FREE);
+        }
+    }
+    release_nodes();
+    inode->num_extents = 0;
+    inode->indirect_ptr = UNAVAILABLE_BLOCK;
+    inode->depth = 0;
+    inode_changed(inode);
+    return result;
+}
+
+//writes back the blocks of the tree under block, batch holds the ones not written yet
+int flush_tree(unsigned int block, unsigned int level, unsigned int *batch, int *num_blocks) {
+    tree_node_t *node = get_node(block, level);
+
+    if (!node) return -1;
+    for (unsigned int i = 0; level && i < node->count; i++) {
+        if (flush_tree(node_index(node)[i].block, level - 1, batch, num_blocks) < 0) {
+            release_node(node);
+            return -1;
+        }
+    }
+    release_node(node);
+    batch[(*num_blocks)++] = block;
+    if (*num_blocks < MAP_BATCH) return 0;
+    *num_blocks = 0;
+    return cache_flush_blocks(batch, MAP_BATCH);
+}
+
+//the most extent tree blocks that placing n held back blocks can take. Each of them may end up
+//an extent of its own, a split leaf keeps at least half a leaf free for the extents after it,
+//and a split takes at most one block per level
+int tree_claim(const inode_t *inode, unsigned int n) {
+    unsigned int half = LEAF_EXTENTS / 2;
+
+    if (!n || (!inode->depth && inode->num_extents + n <= INODE_EXTENTS)) return 0;
+    if (!inode->depth && inode->num_extents + n <= LEAF_EXTENTS) return 1; //the first leaf
+    return (int) (!inode->depth + (n + half - 1) / half * MAX_TREE_DEPTH);
+}
+
+//counts the blocks the handle holds back, and the tree blocks they may need, as taken
+void set_delay_claim(fd_table_t *fd, const inode_t *inode) {
+    delayed_blocks -= fd->delay_claim;
+    fd->delay_claim = fd->delay_blocks ? fd->delay_blocks + tree_claim(inode, fd->delay_blocks) : 0;
+    delayed_blocks += fd->delay_claim;
+}
+
+//blocks held back for the file get their places on disk, in as few runs as the free space allows
+int flush_delayed(int fileID) {
+    fd_table_t *fd = &fd_table[fileID];
+    inode_t *file_inode;
+    unsigned int blocks[DELAY_BLOCKS], done = 0, len;
+    int result = 0;
+
+    if (!fd->delay_blocks) return 0;
+    file_inode = get_inode(fd->inode_idx);
+    if (!file_inode) return -1;
+
+    //the claim goes before the blocks are taken, so that the tree can use what was kept for it
+    delayed_blocks -= fd->delay_claim;
+    fd->delay_claim = 0;
+    for (; done < fd->delay_blocks; done += len) {
+        unsigned int start = get_free_run(fd->delay_blocks - done, &len);
+        if (!start) {
+            fprintf(stderr, "Disk Full! Failed to write %u blocks.\n", fd->delay_blocks - done);
+            result = -1;
+            break;
+        }
+        for (unsigned int i = 0; i < len; i++) {
+            set_block(start + i, USED);
+            blocks[i] = start + i;
+        }
+        if (map_insert(file_inode, fd->delay_first + done, start, len) < 0) {
+            for (unsigned int i = 0; i < len; i++) set_block(start + i, FREE);
+            result = -1;
+            break;
+        }
+        if (cache_writev(blocks, (int) len, fd->delay_data + done * BLOCK_SIZE) < 0) {
+            fprintf(stderr, "Failed to write %u blocks of file\n", len);
+            map_punch(file_inode, fd->delay_first + done, len, 1);
+            result = -1;
+            break;
+        }
+    }
+    //whatever did not get a place stays held back, and claimed, for the next flush
+    fd->delay_blocks -= done;
+    if (fd->delay_blocks) {
+        memmove(fd->delay_data, fd->delay_data + done * BLOCK_SIZE, fd->delay_blocks * BLOCK_SIZE);
+        fd->delay_first += done;
+        set_delay_claim(fd, file_inode);
+    }
+    return result;
+}
+
+int flush_all_delayed() {
+    int result = 0;
+    if (!delayed_blocks) return 0;
+    for (int i = 0; i < fd_capacity; i++) {
+        if (fd_table[i].inode_idx && fd_table[i].delay_blocks && flush_delayed(i) < 0) result = -1;
+    }
+    return result;
+}
+
+//a handle gets its delay buffer with the first block it holds back, sized for delay_max blocks,
+//and a bigger one when delay_max grows while it holds none
+int get_delay_buffer(fd_table_t *fd) {
+    if (fd->delay_data && (fd->delay_size >= (unsigned) delay_max || fd->delay_blocks)) return 0;
+    disk_free_buffer(fd->delay_data);
+    fd->delay_data = disk_alloc_buffer((size_t) delay_max * BLOCK_SIZE);
+    fd->delay_size = fd->delay_data ? (unsigned) delay_max : 0;
+    return fd->delay_data ? 0 : -1;
+}
+
+//takes the leading unmapped blocks of file blocks [first, first + n) into the delay buffer
+//and returns how many it took, 0 when there is no room to hold them back
+int take_delayed(int fileID, inode_t *file_inode, unsigned int first, int n, const unsigned int *blocks) {
+    fd_table_t *fd = &fd_table[fileID];
+    unsigned int end = fd->delay_first + fd->delay_blocks;
+    int holes = 0, more, room = delay_max < (int) fd->delay_size ? delay_max : (int) fd->delay_size;
+
+    while (holes < n && !blocks[holes]) holes++;
+    if (!holes) return 0;
+
+    //only a run next to what is held back can join it, anything else starts over
+    if (!fd->delay_blocks || first < fd->delay_first || first > end) {
+        if (fd->delay_blocks && flush_delayed(fileID) < 0) return 0;
+        fd->delay_first = first;
+        end = first;
+    }
+    more = (int) (first + holes - end);
+    if (more > 0) {
+        if (room - (int) fd->delay_blocks <= 0 && first == end) {
+            //the buffer is full: it goes to disk and this run starts the next one
+            if (flush_delayed(fileID) < 0) return 0;
+            fd->delay_first = first;
+        }
+        if (more > room - (int) fd->delay_blocks) more = room - (int) fd->delay_blocks;
+        //the blocks, and the tree blocks to place them, have to be free on top of what others claim
+        while (more > 0 && count_free_blocks() + (int) fd->delay_claim <
+                           (int) fd->delay_blocks + more + tree_claim(file_inode, fd->delay_blocks + more)) {
+            more--;
+        }
+        if (more > 0) {
+            memset(fd->delay_data + fd->delay_blocks * BLOCK_SIZE, 0, more * BLOCK_SIZE);
+            fd->delay_blocks += (unsigned) more;
+            set_delay_claim(fd, file_inode);
+        }
+    }
+    end = fd->delay_first + fd->delay_blocks;
+    if (first >= end) return 0;
+    return end - first < (unsigned) holes ? (int) (end - first) : holes;
 }
 
 
 int sfs_fopen(char *name) {
     //Implement sfs_fopen here
-    int directory_ptr = get_directory_ptr_from_name(name);
-    unsigned int fount_inode = root_dir[directory_ptr].inode_idx;
+    int directory_ptr;
+    unsigned int fount_inode;
     int fd;
 
+    if (strlen(name) >= MAXFILENAME) {
+        fprintf(stderr, "File name '%s' is too long", name);
+        return -1;
+    }
+    disk_stats_site("sfs_fopen");
+    directory_ptr = get_directory_ptr_from_name(name);
+    fount_inode = root_dir[directory_ptr].inode_idx;
+
     if (!fount_inode) {
-        unsigned int available_inode = get_free_inode(), available_block = get_free_block();
-        if (!available_block || !available_inode) {
-            fprintf(stderr, "No space to open file! All blocks or Inodes occupied.");
+        //a new file starts empty, but it still needs room for its first block
+        if (!count_free_blocks()) {
+            fprintf(stderr, "No space to open file! All blocks occupied.");
+            return -2;
+        }
+        unsigned int available_inode = get_free_inode();
+        if (!available_inode) {
+            fprintf(stderr, "No space to open file! All Inodes occupied.");
             return -2;
         }
-        //TODO: check max 16 char for name + . + 3 char for ext
-        add_new_file_dir_entry(available_inode, name);
-        add_new_inode(available_inode, 0x660, available_block);
+        //the inode's block of the table has to be in before the inode is filled in
+        if (!get_inode(available_inode)) {
+            set_inode(available_inode, FREE);
+            return -1;
+        }
+        if (!add_new_file_dir_entry(available_inode, name)) {
+            set_inode(available_inode, FREE);
+            fprintf(stderr, "No space to open file! Directory full.");
+            return -2;
+        }
+        add_new_inode(available_inode, 0x660);
         fount_inode = available_inode;
         fd = -1;
     } else {
@@ -244,6 +1355,12 @@ int sfs_fopen(char *name) {
         }
         fd_table[fd].inode_idx = fount_inode;
         fd_table[fd].rd_write_ptr = 0;
+        fd_table[fd].ra_next = 0;
+        fd_table[fd].ra_window = 0;
+        fd_table[fd].ra_end = 0;
+        fd_table[fd].delay_blocks = 0;
+        fd_table[fd].delay_claim = 0;
+        open_fd[fount_inode] = fd + 1;
         return fd;
     }
     return fd; //already open
@@ -252,116 +1369,514 @@ int sfs_fopen(char *name) {
 int sfs_fclose(int fileID) {
 
     //Implement sfs_fclose here
+    if (!fd_is_open(fileID)) return -1;
+    disk_stats_site("sfs_fclose");
+
+    //the file's size is final for now, so its held back blocks can be placed together;
+    //when they cannot be, the handle stays open so that they are not lost
+    if (flush_delayed(fileID) < 0) return -1;
+    sync_sfs();
+    disk_free_buffer(fd_table[fileID].delay_data);
+    fd_table[fileID].delay_data = NULL;
+    fd_table[fileID].delay_size = 0;
+    open_fd[fd_table[fileID].inode_idx] = 0;
     fd_table[fileID].inode_idx = UNAVAILABLE_INODE;
     fd_table[fileID].rd_write_ptr = 0;
+    fd_free[fd_free_top++] = fileID;
+    return 0; //writes stay in the cache until sfs_sync or sfs_fsync
+}
+
+//barrier: every pending block reaches the image in one batch before a single flush
+int sfs_sync() {
+    disk_stats_site("sfs_sync");
+    int result = flush_all_delayed();
+    return sync_everything() < 0 ? -1 : result;
+}
+
+//writes back blocks [first, first + len) from the cache, MAP_BATCH of them at a time
+int flush_range(unsigned int first, unsigned int len, unsigned int *batch) {
+    for (unsigned int done = 0; done < len; done += MAP_BATCH) {
+        int n = len - done < MAP_BATCH ? (int) (len - done) : MAP_BATCH;
+        for (int i = 0; i < n; i++) batch[i] = first + done + i;
+        if (cache_flush_blocks(batch, n) < 0) return -1;
+    }
     return 0;
 }
 
-int sfs_fread(int fileID, char *buf, int length) {
+//like sfs_sync, but only the file's own data and extent tree blocks and the metadata blocks are written back
+int sfs_fsync(int fileID) {
+
+    if (!fd_is_open(fileID)) return -1;
+    disk_stats_site("sfs_fsync");
+
+    inode_t *file_inode = get_inode(fd_table[fileID].inode_idx);
+    if (!file_inode) return -1;
+    unsigned int blocks[MAP_BATCH];
+    unsigned int file_blocks = (file_inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int num_blocks = 0;
+
+    if (flush_delayed(fileID) < 0) return -1;
+    sync_sfs();
+    //data first, a batch at a time, then the metadata that points at it
+    for (unsigned int first = 0; first < file_blocks; first += MAP_BATCH) {
+        int n = file_blocks - first < MAP_BATCH ? (int) (file_blocks - first) : MAP_BATCH;
+        int mapped = map_blocks(file_inode, first, n, blocks);
+        for (int i = 0; i < n; i++) blocks[i] &= ~EXTENT_UNWRITTEN;
+        if (mapped < 0 || cache_flush_blocks(blocks, n) < 0) {
+            fprintf(stderr, "Failed to write back blocks %u to %u of file\n", first, first + n - 1);
+            return -1;
+        }
+    }
+    if (file_inode->depth && (flush_tree(file_inode->indirect_ptr, file_inode->depth - 1, blocks, &num_blocks) < 0 ||
+                              cache_flush_blocks(blocks, num_blocks) < 0)) {
+        fprintf(stderr, "Failed to write back the extent tree of file\n");
+        return -1;
+    }
+    if (flush_range(sb.inode_table_block, sb.inode_table_blocks + sb.dir_len, blocks) < 0 ||
+        flush_range(sb.inode_map_block, sb.inode_map_len + sb.csum_table_len + sb.free_map_len, blocks) < 0) {
+        fprintf(stderr, "Failed to write back the metadata blocks of file\n");
+        return -1;
+    }
+    return sync_disk();
+}
 
-    //Implement sfs_fread here
-    int inode_idx = fd_table[fileID].inode_idx;
-    unsigned int cur_pos = fd_table[fileID].rd_write_ptr;
-    char buffer[BLOCK_SIZE];
+//logical blocks of the cluster that hold data in a file of size bytes
+int cluster_used(unsigned int cluster, unsigned int size) {
+    int used = (int) ((size + BLOCK_SIZE - 1) / BLOCK_SIZE) - (int) cluster * CLUSTER_BLOCKS;
+    if (used < 0) return 0;
+    return used < CLUSTER_BLOCKS ? used : CLUSTER_BLOCKS;
+}
 
-    inode_t file_inode = inode_table[inode_idx];
+//the cluster's blocks are mapped from its first one on, the ones it does not need are holes
+int cluster_run(const unsigned int *slots) {
+    int run = 0;
+    while (run < CLUSTER_BLOCKS && slots[run]) run++;
+    return run;
+}
 
-    //trying to read beyond the file
-    if (cur_pos + length > file_inode.size) {
-        length = file_inode.size - cur_pos;
+//a cluster is stored compressed when it has fewer blocks than it holds data for
+int load_cluster(inode_t *inode, unsigned int cluster, unsigned int size, char *dest) {
+    unsigned int slots[CLUSTER_BLOCKS], packed_len;
+    int used = cluster_used(cluster, size), run;
+    char *packed = cluster_packed;
+
+    memset(dest, 0, CLUSTER_BYTES);
+    if (!used) return 0;
+    if (map_blocks(inode, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS, slots) < 0) return -1;
+    run = cluster_run(slots);
+    if (run >= used) return cache_readv(slots, used, dest);
+
+    if (cache_readv(slots, run, packed) < 0) return -1;
+    memcpy(&packed_len, packed, sizeof(packed_len));
+    if (packed_len > run * BLOCK_SIZE - sizeof(packed_len) ||
+        lz_decompress(packed + sizeof(packed_len), (int) packed_len, dest, CLUSTER_BYTES) < 0) {
+        fprintf(stderr, "Compressed cluster %u is corrupt\n", cluster);
+        return -1;
+    }
+    return 0;
+}
+
+//compresses the cluster when that saves at least a block, then resizes its run to fit
+int store_cluster(inode_t *inode, unsigned int cluster, unsigned int size, const char *src) {
+    unsigned int slots[CLUSTER_BLOCKS], first = cluster * CLUSTER_BLOCKS, packed_len = 0;
+    int used = cluster_used(cluster, size), run = used, missing = 0;
+    int bytes = (int) (size - cluster * CLUSTER_BYTES) < CLUSTER_BYTES ? (int) (size - cluster * CLUSTER_BYTES)
+                                                                       : CLUSTER_BYTES;
+    char *packed = cluster_packed;
+    const char *out = src;
+
+    if (used > 1) {
+        packed_len = (unsigned) lz_compress(src, bytes, packed + sizeof(packed_len),
+                                            (used - 1) * BLOCK_SIZE - (int) sizeof(packed_len));
+    }
+    if (packed_len) {
+        memcpy(packed, &packed_len, sizeof(packed_len));
+        run = (int) ((packed_len + sizeof(packed_len) + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        memset(packed + sizeof(packed_len) + packed_len, 0, run * BLOCK_SIZE - sizeof(packed_len) - packed_len);
+        out = packed;
+    }
+
+    //check for room first so a full disk leaves the cluster as it was
+    if (map_blocks(inode, first, CLUSTER_BLOCKS, slots) < 0) return -1;
+    for (int i = 0; i < run; i++) {
+        if (!slots[i]) missing++;
+    }
+    if (missing > count_free_blocks()) {
+        fprintf(stderr, "Disk Full! Failed to write %d blocks.\n", missing);
+        return -1;
+    }
+    for (int i = 0; i < run; i++) {
+        if (slots[i]) continue;
+        slots[i] = get_free_block();
+        set_block(slots[i], USED);
+        if (map_insert(inode, first + i, slots[i], 1) < 0) {
+            set_block(slots[i], FREE);
+            return -1;
+        }
+    }
+    if (run < CLUSTER_BLOCKS && map_punch(inode, first + run, CLUSTER_BLOCKS - run, 1) < 0) return -1;
+    return cache_writev(slots, run, out);
+}
+
+int read_compressed(unsigned int inode_idx, unsigned int cur_pos, char *buf, int length) {
+    inode_t *file_inode = get_inode(inode_idx);
+    unsigned int end = cur_pos + length;
+
+    for (unsigned int c = cur_pos / CLUSTER_BYTES; c * CLUSTER_BYTES < end; c++) {
+        unsigned int from = cur_pos > c * CLUSTER_BYTES ? cur_pos : c * CLUSTER_BYTES,
+                to = end < (c + 1) * CLUSTER_BYTES ? end : (c + 1) * CLUSTER_BYTES;
+        if (cluster_cache.inode_idx != inode_idx || cluster_cache.cluster != c) {
+            cluster_cache.inode_idx = UNAVAILABLE_INODE;
+            if (load_cluster(file_inode, c, file_inode->size, cluster_cache.data) < 0) return -1;
+            cluster_cache.inode_idx = inode_idx;
+            cluster_cache.cluster = c;
+        }
+        memcpy(buf + from - cur_pos, cluster_cache.data + from - c * CLUSTER_BYTES, to - from);
+    }
+    return length;
+}
+
+//rewrites every cluster the write touches, returns how much of it made it
+int write_compressed(unsigned int inode_idx, unsigned int cur_pos, const char *buf, int length) {
+    inode_t *file_inode = get_inode(inode_idx);
+    unsigned int end = cur_pos + length, written = 0;
+
+    for (unsigned int c = cur_pos / CLUSTER_BYTES; c * CLUSTER_BYTES < end; c++) {
+        unsigned int from = cur_pos > c * CLUSTER_BYTES ? cur_pos : c * CLUSTER_BYTES,
+                to = end < (c + 1) * CLUSTER_BYTES ? end : (c + 1) * CLUSTER_BYTES,
+                size = to > file_inode->size ? to : file_inode->size;
+        if (cluster_cache.inode_idx != inode_idx || cluster_cache.cluster != c) {
+            cluster_cache.inode_idx = UNAVAILABLE_INODE;
+            if (load_cluster(file_inode, c, file_inode->size, cluster_cache.data) < 0) break;
+        }
+        cluster_cache.inode_idx = UNAVAILABLE_INODE;
+        memcpy(cluster_cache.data + from - c * CLUSTER_BYTES, buf + from - cur_pos, to - from);
+        if (store_cluster(file_inode, c, size, cluster_cache.data) < 0) break;
+        cluster_cache.inode_idx = inode_idx;
+        cluster_cache.cluster = c;
+        file_inode->size = size;
+        inode_changed(file_inode);
+        written = to - cur_pos;
+    }
+    return (int) written;
+}
+
+//only while the file is empty: clusters already on disk are not converted
+int sfs_fcompress(int fileID, int on) {
+
+    if (!fd_is_open(fileID)) return -1;
+    disk_stats_site("sfs_fcompress");
+
+    inode_t *file_inode = get_inode(fd_table[fileID].inode_idx);
+    if (!file_inode) return -1;
+    if (file_inode->size) return -2;
+
+    if (on) file_inode->flags |= INODE_COMPRESSED;
+    else file_inode->flags &= ~INODE_COMPRESSED;
+    inode_changed(file_inode);
+    sync_sfs();
+    return 0;
+}
+
+//0 turns read-ahead off
+void sfs_set_readahead(int max_blocks) {
+    read_ahead_max = max_blocks < READ_AHEAD_MAX ? max_blocks : READ_AHEAD_MAX;
+}
+
+//0 gives written blocks their disk blocks right away
+void sfs_set_delayed_alloc(int max_blocks) {
+    flush_all_delayed();
+    delay_max = max_blocks < DELAY_BLOCKS ? max_blocks : DELAY_BLOCKS;
+}
+
+//grows the window while reads follow each other and starts fetching the blocks it covers
+void read_ahead(int fileID, unsigned int cur_pos, int length) {
+    fd_table_t *fd = &fd_table[fileID];
+    inode_t *file_inode = get_inode(fd->inode_idx);
+    if (!file_inode) return;
+    unsigned int blocks[READ_AHEAD_MAX];
+    unsigned int next = (cur_pos + length + BLOCK_SIZE - 1) / BLOCK_SIZE,
+            file_blocks = (file_inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE, start, end;
+    int num_blocks = 0;
+
+    if (cur_pos != fd->ra_next || !read_ahead_max) {
+        fd->ra_window = 0;
+        fd->ra_end = 0;
+    } else {
+        fd->ra_window = fd->ra_window ? fd->ra_window * 2 : READ_AHEAD_MIN;
+        if (fd->ra_window > (unsigned) read_ahead_max) fd->ra_window = (unsigned) read_ahead_max;
+    }
+    fd->ra_next = cur_pos + length;
+    if (!fd->ra_window) return;
+
+    //only blocks past what is already on its way
+    start = next > fd->ra_end ? next : fd->ra_end;
+    end = next + fd->ra_window < file_blocks ? next + fd->ra_window : file_blocks;
+    if (start >= end) return;
+    fd->ra_end = end;
+    if (map_blocks(file_inode, start, (int) (end - start), blocks) < 0) return;
+    for (unsigned int i = 0; i < end - start; i++) {
+        if (blocks[i] && !(blocks[i] & EXTENT_UNWRITTEN)) blocks[num_blocks++] = blocks[i];
     }
+    if (num_blocks) cache_prefetch(blocks, num_blocks);
+}
+
+int sfs_fread(int fileID, char *buf, int length) {
 
-    if (length <= 0) return length;
+    if (!fd_is_open(fileID)) return -1;
+    disk_stats_site("sfs_fread");
 
-    int num_used_pts = length / BLOCK_SIZE, incomplete_block = length % BLOCK_SIZE,
-            cur_ptr = cur_pos / BLOCK_SIZE, pos_in_block= cur_pos%BLOCK_SIZE,
-            last_used_ptr = file_inode.size/BLOCK_SIZE + pos_in_block ? 1 : 0,
-            bytes_used = 0,  read_length = 0;
-    num_used_pts += pos_in_block ? 1 :0;
-    assert(num_used_pts <= last_used_ptr); //lenght is not greater than file size
-    assert(last_used_ptr < MAX_DIRECT_DATA); //size is not greater than current limit
-    for (int block_idx =0 ; cur_ptr <= num_used_pts && cur_ptr < MAX_DIRECT_DATA;
-           cur_ptr++, bytes_used += read_length, pos_in_block = 0) {
+    unsigned int cur_pos = fd_table[fileID].rd_write_ptr;
+    inode_t *file_inode = get_inode(fd_table[fileID].inode_idx);
+    if (!file_inode) return -1;
 
-        block_idx = file_inode.data_ptrs[cur_ptr];
-        assert(block_idx); //block_idx cannot be empty since it's less than file size
+    //trying to read beyond the file
+    if (cur_pos + length > file_inode->size) {
+        length = file_inode->size - cur_pos;
+    }
 
-        if (cur_ptr == num_used_pts){
-            read_length = BLOCK_SIZE - pos_in_block;
-        }else{
-            read_length = incomplete_block - pos_in_block;
+    if (length <= 0) return 0;
+
+    if (file_inode->flags & INODE_COMPRESSED) {
+        if (read_compressed(fd_table[fileID].inode_idx, cur_pos, buf, length) < 0) {
+            fprintf(stderr, "Failed to read compressed file\n");
+            return -1;
         }
-        read_blocks(block_idx, 1, &buffer[0]);
-        memcpy(buf + bytes_used, buffer+pos_in_block, read_length);
+        fd_table[fileID].rd_write_ptr += (unsigned) length;
+        read_ahead(fileID, cur_pos, length);
+        return length;
     }
 
-    fd_table[fileID].rd_write_ptr += (unsigned) read_length;
-    return read_length;
+    //a batch of blocks at a time, with all of its misses in flight together; blocks of one
+    //extent are adjacent on disk, so the request queue moves each extent in one transfer
+    unsigned int blocks[MAP_BATCH];
+    for (int done = 0; done < length;) {
+        unsigned int pos = cur_pos + done, first_ptr = pos / BLOCK_SIZE;
+        int part = length - done, num_blocks = (int) ((pos % BLOCK_SIZE + part + BLOCK_SIZE - 1) / BLOCK_SIZE);
 
+        if (num_blocks > MAP_BATCH) {
+            num_blocks = MAP_BATCH;
+            part = MAP_BATCH * BLOCK_SIZE - (int) (pos % BLOCK_SIZE);
+        }
+        if (map_blocks(file_inode, first_ptr, num_blocks, blocks) < 0) return -1;
+
+        //blocks without a disk block are in the delay buffer or are holes;
+        //holes and unwritten blocks read as zeros
+        fd_table_t *fd = &fd_table[fileID];
+        int run = 1;
+        while (run < num_blocks && !blocks[run] == !blocks[0] &&
+               (blocks[run] & EXTENT_UNWRITTEN) == (blocks[0] & EXTENT_UNWRITTEN)) {
+            run++;
+        }
+        if (run < num_blocks) {
+            num_blocks = run;
+            part = run * BLOCK_SIZE - (int) (pos % BLOCK_SIZE);
+        }
+        if (!blocks[0]) {
+            unsigned int delay_end = fd->delay_first + fd->delay_blocks, stop = first_ptr + num_blocks;
+            int held = first_ptr >= fd->delay_first && first_ptr < delay_end;
+            //the run ends where the delay buffer starts or ends
+            if (held && delay_end < stop) stop = delay_end;
+            if (!held && fd->delay_blocks && first_ptr < fd->delay_first && fd->delay_first < stop) stop = fd->delay_first;
+            if (stop < first_ptr + num_blocks) {
+                num_blocks = (int) (stop - first_ptr);
+                part = num_blocks * BLOCK_SIZE - (int) (pos % BLOCK_SIZE);
+            }
+            if (held) {
+                memcpy(buf + done, fd->delay_data + (first_ptr - fd->delay_first) * BLOCK_SIZE + pos % BLOCK_SIZE, part);
+            } else {
+                memset(buf + done, 0, part);
+            }
+        } else if (blocks[0] & EXTENT_UNWRITTEN) {
+            memset(buf + done, 0, part);
+        } else if (cache_read_bytes(blocks, num_blocks, pos % BLOCK_SIZE, part, buf + done) < 0) {
+            fprintf(stderr, "Failed to read %d blocks of file\n", num_blocks);
+            return -1;
+        }
+        done += part;
+    }
 
+    fd_table[fileID].rd_write_ptr += (unsigned) length;
+    read_ahead(fileID, cur_pos, length);
+    return length;
 }
 
 int sfs_fwrite(int fileID, const char *buf, int length) {
-    int inode_idx = fd_table[fileID].inode_idx;
+
+    if (!fd_is_open(fileID)) return -1;
+    disk_stats_site("sfs_fwrite");
+
     unsigned int cur_pos = fd_table[fileID].rd_write_ptr;
-    char buffer[BLOCK_SIZE];
+    inode_t *file_inode = get_inode(fd_table[fileID].inode_idx);
+    if (!file_inode) return -1;
 
-    inode_t file_inode = inode_table[inode_idx];
+    if (length <= 0) return 0;
 
-    //trying to read beyond the file
-    if (cur_pos + length > file_inode.size) {
-        length = file_inode.size - cur_pos;
-    }
-
-    if (length <= 0) return length;
-
-    int num_used_ptrs = length / BLOCK_SIZE, incomplete_block = length % BLOCK_SIZE,
-            cur_ptr = cur_pos / BLOCK_SIZE, pos_in_block= cur_pos%BLOCK_SIZE,
-            last_used_ptrs = file_inode.size/BLOCK_SIZE + pos_in_block ? 1 : 0,
-            bytes_used = 0,  read_length = 0;
-    num_used_ptrs += pos_in_block ? 1 :0;
-    assert(num_used_ptrs <= MAX_DIRECT_DATA);
-    assert(last_used_ptrs < MAX_DIRECT_DATA);
-    for (int block_idx=0; cur_ptr <= num_used_ptrs && cur_ptr < MAX_DIRECT_DATA;
-           cur_ptr++, bytes_used += read_length, pos_in_block = 0) {
-
-         block_idx = file_inode.data_ptrs[cur_ptr];
-        if (!block_idx){
-            block_idx = get_free_block();
-            if (!block_idx) {
-                fprintf(stderr, "Disk Full! Failed to write %d blocks.\n",length- read_length);
-                return read_length;
+    if (file_inode->flags & INODE_COMPRESSED) {
+        length = write_compressed(fd_table[fileID].inode_idx, cur_pos, buf, length);
+        fd_table[fileID].rd_write_ptr += (unsigned) length;
+        disk_stats_logical((unsigned) length);
+        sync_sfs();
+        return length;
+    }
+
+    unsigned int blocks[MAP_BATCH];
+    fd_table_t *fd = &fd_table[fileID];
+    int done = 0, full = 0, place_now = !delay_max;
+    while (done < length && !full) {
+        unsigned int pos = cur_pos + done, first_ptr = pos / BLOCK_SIZE;
+        int part = length - done, num_blocks = (int) ((pos % BLOCK_SIZE + part + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+        if (num_blocks > MAP_BATCH) num_blocks = MAP_BATCH;
+        if (map_blocks(file_inode, first_ptr, num_blocks, blocks) < 0) break;
+
+        //new blocks wait in memory and get their disk blocks together once the file is flushed
+        if (!place_now && !blocks[0]) {
+            if (get_delay_buffer(fd) < 0) {
+                fprintf(stderr, "Could not allocate a delay buffer of %d blocks\n", delay_max);
+                break;
+            }
+            int taken = take_delayed(fileID, file_inode, first_ptr, num_blocks, blocks);
+            if (!taken) {
+                //too little room left to hold blocks back: the held ones go to disk, and from
+                //here on new blocks get theirs right away, as they do without delayed allocation
+                if (flush_delayed(fileID) < 0) break;
+                place_now = 1;
+                continue;
+            }
+            if (part > taken * BLOCK_SIZE - (int) (pos % BLOCK_SIZE)) part = taken * BLOCK_SIZE - (int) (pos % BLOCK_SIZE);
+            memcpy(fd->delay_data + (first_ptr - fd->delay_first) * BLOCK_SIZE + pos % BLOCK_SIZE, buf + done, part);
+            done += part;
+            if (pos + part > file_inode->size) file_inode->size = pos + part;
+            continue;
+        }
+        //one kind of block at a time: unwritten ones are not read in, and lose the flag once written
+        unsigned int unwritten = blocks[0] & EXTENT_UNWRITTEN;
+        int run = 1;
+        while (run < num_blocks && (blocks[run] & EXTENT_UNWRITTEN) == unwritten && (blocks[run] || place_now)) {
+            run++;
+        }
+        num_blocks = run;
+        //writing unwritten blocks splits their extents, which the claim for the held back ones
+        //did not count on, so those get their places first
+        if (unwritten && fd->delay_blocks) {
+            if (flush_delayed(fileID) < 0) break;
+            continue;
+        }
+        for (int i = 0; i < num_blocks; i++) blocks[i] &= ~EXTENT_UNWRITTEN;
+
+        //without delayed allocation every block we are about to touch gets a home on disk now,
+        //next to the one before it when it is free
+        for (int i = 0; i < num_blocks; i++) {
+            if (blocks[i]) continue;
+            unsigned int block_idx = count_free_blocks() > 0 ? get_free_block() : UNAVAILABLE_BLOCK;
+            if (block_idx) set_block(block_idx, USED);
+            if (!block_idx || map_insert(file_inode, first_ptr + i, block_idx, 1) < 0) {
+                fprintf(stderr, "Disk Full! Failed to write %d blocks.\n", num_blocks - i);
+                if (block_idx) set_block(block_idx, FREE);
+                num_blocks = i;
+                full = 1;
+                break;
             }
-            all_blocks[block_idx] = USED;
+            blocks[i] = block_idx;
+        }
+        if (!num_blocks) break;
+        if (part > num_blocks * BLOCK_SIZE - (int) (pos % BLOCK_SIZE)) {
+            part = num_blocks * BLOCK_SIZE - (int) (pos % BLOCK_SIZE);
+        }
 
+        //partially overwritten blocks that already hold data are read in by the cache
+        int old_bytes = unwritten ? 0 : (int) file_inode->size - (int) (first_ptr * BLOCK_SIZE);
+        if (cache_write_bytes(blocks, num_blocks, pos % BLOCK_SIZE, part, buf + done, old_bytes) < 0) {
+            fprintf(stderr, "Failed to write %d blocks of file\n", num_blocks);
+            break;
+        }
+        for (int i = 0, len; unwritten && i < num_blocks; i += len) {
+            for (len = 1; i + len < num_blocks && blocks[i + len] == blocks[i] + len; len++);
+            if (map_written(file_inode, first_ptr + i, blocks[i], (unsigned) len) < 0) {
+                fprintf(stderr, "Failed to map %d written blocks of file\n", len);
+                full = 1;
+                break;
+            }
         }
+        done += part;
+        if (pos + part > file_inode->size) file_inode->size = pos + part;
+    }
+
+    fd_table[fileID].rd_write_ptr += (unsigned) done;
+    disk_stats_logical((unsigned) done);
+    if (done) inode_changed(file_inode);
+    sync_sfs();
+    return done;
+}
 
-        if (cur_ptr == num_used_ptrs){
-            read_length = BLOCK_SIZE - pos_in_block;
-        }else{
-            read_length = incomplete_block - pos_in_block;
+//reserves disk blocks for [offset, offset + length), in as few runs as the free space allows;
+//they read as zeros until written, and the file grows to cover them. Past the end of the
+//file, the gap from the old end on is reserved too, so that every block below the size is mapped
+int sfs_fallocate(int fileID, int offset, int length) {
+
+    if (!fd_is_open(fileID) || offset < 0 || length <= 0) return -1;
+    disk_stats_site("sfs_fallocate");
+
+    inode_t *file_inode = get_inode(fd_table[fileID].inode_idx);
+    if (!file_inode) return -1;
+    unsigned int from = (unsigned) offset < file_inode->size ? (unsigned) offset : file_inode->size;
+    unsigned int blocks[MAP_BATCH], first = from / BLOCK_SIZE,
+            end = (unsigned) (((unsigned long long) offset + (unsigned) length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    int holes = 0;
+
+    if (file_inode->flags & INODE_COMPRESSED) return -1;
+    //the held back blocks would otherwise be mapped over the reserved ones
+    if (flush_delayed(fileID) < 0) return -2;
+
+    //all or nothing, so count what is missing first
+    for (unsigned int b = first; b < end; b += MAP_BATCH) {
+        int n = end - b < MAP_BATCH ? (int) (end - b) : MAP_BATCH;
+        if (map_blocks(file_inode, b, n, blocks) < 0) return -2;
+        for (int i = 0; i < n; i++) {
+            if (!blocks[i]) holes++;
         }
-        write_blocks(block_idx, 1, &buffer[0]);
-        memcpy(buffer+pos_in_block,buf + bytes_used,  read_length);
-        fd_table[fileID].rd_write_ptr += (unsigned) read_length;
-        file_inode.size += cur_pos + read_length;
     }
-    for (int unused_ptr = num_used_ptrs +1; unused_ptr <= last_used_ptrs; unused_ptr++){
-        int block_index = file_inode.data_ptrs[unused_ptr];
-        all_blocks[block_index] = FREE;
+    if (holes > count_free_blocks()) {
+        fprintf(stderr, "Disk Full! Failed to reserve %d blocks.\n", holes);
+        return -2;
     }
-    return read_length;
 
+    for (unsigned int b = first; b < end; b += MAP_BATCH) {
+        int n = end - b < MAP_BATCH ? (int) (end - b) : MAP_BATCH;
+        if (map_blocks(file_inode, b, n, blocks) < 0) return -2;
+        for (int i = 0; i < n;) {
+            unsigned int gap = 1, start, len;
+            if (blocks[i]) {
+                i++;
+                continue;
+            }
+            while (i + (int) gap < n && !blocks[i + gap]) gap++;
+            start = get_free_run(gap, &len);
+            if (!len) return -2;
+            for (unsigned int k = 0; k < len; k++) set_block(start + k, USED);
+            if (map_insert(file_inode, b + i, start, len | EXTENT_UNWRITTEN) < 0) {
+                for (unsigned int k = 0; k < len; k++) set_block(start + k, FREE);
+                return -2;
+            }
+            i += (int) len;
+        }
+    }
 
+    if ((unsigned) offset + (unsigned) length > file_inode->size) file_inode->size = (unsigned) offset + (unsigned) length;
+    inode_changed(file_inode);
+    sync_sfs();
+    return 0;
 }
 
 int sfs_fseek(int fileID, int loc) {
 
     //should check if loc is a valid length
-    if (loc < 0) return  -1;
-    inode_t i = inode_table[fd_table[fileID].inode_idx];
-    if (loc> i.size) return -2;
-    if (loc % BLOCK_SIZE > MAX_DIRECT_DATA) return -3;
+    if (loc < 0 || !fd_is_open(fileID)) return  -1;
+    disk_stats_site("sfs_fseek");
+    inode_t *i = get_inode(fd_table[fileID].inode_idx);
+    if (!i) return -1;
+    if (loc> i->size) return -2;
 
     fd_table[fileID].rd_write_ptr = (unsigned) loc;
     return 0;
@@ -369,46 +1884,37 @@ int sfs_fseek(int fileID, int loc) {
 
 int sfs_remove(char *file) {
     const char *path = file;
+    disk_stats_site("sfs_remove");
     int directory_ptr = get_directory_ptr_from_name(path);
-    if (directory_ptr == -1) {
+    if (directory_ptr == UNAVAILABLE_INODE) {
         fprintf(stderr, "Cannot remove file '%s'. File Does Not Exist", file);
         return -1;
     }
 
-    unsigned int inode_idx = root_dir[directory_ptr].inode_idx, block;
-    inode_t cur_inode = inode_table[inode_idx];
+    unsigned int inode_idx = root_dir[directory_ptr].inode_idx;
+    inode_t *cur_inode = get_inode(inode_idx);
+    if (!cur_inode) return -1;
+    //its handle would be left on a freed inode that the next new file gets
+    if (open_fd[inode_idx]) {
+        fprintf(stderr, "Cannot remove file '%s'. File is open\n", file);
+        return -1;
+    }
 
-    root_dir[directory_ptr].inode_idx = UNAVAILABLE_INODE;
+    dir_delete(directory_ptr);
+    dir_dirty[directory_ptr / DIR_PER_BLOCK] = 1;
+    if (cluster_cache.inode_idx == inode_idx) cluster_cache.inode_idx = UNAVAILABLE_INODE;
     //clear the dir entry
 
-    //clear the data blocks
+    //clear the data blocks and the extent tree
     //set 0 in free block map where the file used to be
-    for (int i = 0; i < MAX_DIRECT_DATA; i++) {
-        block = cur_inode.data_ptrs[i];
-        if (block) {
-            cur_inode.data_ptrs[i] = UNAVAILABLE_BLOCK;
-            all_blocks[block] = FREE;
-        }
-        else break; //All inodes arranged serially
-    }
-    //Do the same for indirect ptrs
-    if (cur_inode.indirect_ptr) {
-
-        all_blocks[cur_inode.indirect_ptr] = 0;
-//        for(int i = 0; i<MAX_DATA_PER_INDIRECT; i++){
-//            block =  cur_inode.data_ptrs[i];
-//            if (block){
-//                cur_inode.data_ptrs[i] = UNAVAILABLE_BLOCK;
-//                free_blocks[block] = 0;
-//            }
-//            else break; //All inodes arranged serially
-//        }
-        cur_inode.indirect_ptr = 0;
-    }
-    cur_inode.size = 0;
-    cur_inode.link_cnt = 0;
-    cur_inode.mode = 0;
-
-
+    free_extents(cur_inode);
+    cur_inode->size = 0;
+    cur_inode->link_cnt = 0;
+    cur_inode->mode = 0;
+    cur_inode->flags = 0;
+    inode_changed(cur_inode);
+    set_inode(inode_idx, FREE);
+
+    sync_sfs();
     return 0;
 }
@@ -1,25 +1,26 @@
 
-#define MAXFILENAME 16
+#define MAXFILENAME 21
 #define EXT_SIZE 3
 #define SEP '.'
 
 #define SUPERBLOCK 0
 #define UNAVAILABLE_BLOCK SUPERBLOCK
-#define INODE_TABLE_BLOCK 1
-#define DIRECTORY_TABLE_BLOCK 2
-#define FIRST_AVAILABLE_BLOCK 3
+#define INODE_TABLE_BLOCK 1 //the first, the directory follows the last
 
 #define ROOT_INODE 0
 #define UNAVAILABLE_INODE ROOT_INODE
 #define FIRST_AVAILABLE_INODE 1
 
-#define MAX_DIRECT_DATA 10
-#define MAX_DATA_PER_INDIRECT MAX_DIRECT_DATA
+#define INODE_EXTENTS 3
+#define MAX_TREE_DEPTH 3 //single, double or triple indirect
 
 #define FREE 0
 #define USED 1
 
-void mksfs(int fresh);
+#define INODE_COMPRESSED 0x1
+#define EXTENT_UNWRITTEN 0x80000000u //in an extent's len: reserved by sfs_fallocate, reads as zeros
+
+int mksfs(int fresh);
 int sfs_getnextfilename(char *fname);
 int sfs_getfilesize(const char* path);
 int sfs_fopen(char *name);
@@ -28,6 +29,13 @@ int sfs_fread(int fileID, char *buf, int length);
 int sfs_fwrite(int fileID, const char *buf, int length);
 int sfs_fseek(int fileID, int loc);
 int sfs_remove(char *file);
+int sfs_sync();
+int sfs_fsync(int fileID);
+int sfs_fcompress(int fileID, int on);
+int sfs_fallocate(int fileID, int offset, int length);
+void sfs_set_readahead(int max_blocks);
+void sfs_set_delayed_alloc(int max_blocks);
+int sfs_set_geometry(int block_size, int num_blocks, int num_inodes);
 
 
 typedef struct super_block {
@@ -36,22 +44,50 @@ typedef struct super_block {
 	unsigned int fs_size;
 	unsigned int inode_table_len;
 	unsigned int root_dir_inode;
+	unsigned int csum_table_block;
+	unsigned int csum_table_len;
+	unsigned int free_map_block;
+	unsigned int free_map_len;
+	unsigned int inode_map_block;
+	unsigned int inode_map_len;
+	unsigned int num_blocks;
+	unsigned int inode_table_block;
+	unsigned int inode_table_blocks;
+	unsigned int dir_block;
+	unsigned int dir_len;
 } super_block_t;
 
 
+typedef struct extent {
+    unsigned int logical; //first block of the file it maps
+    unsigned int start;   //first block on disk
+    unsigned int len;
+} extent_t;
+
 typedef struct inode { 
 	unsigned int mode;
 	unsigned int link_cnt;
 	unsigned int uid;
 	unsigned int gid;
 	unsigned int size;
-	unsigned int data_ptrs[MAX_DIRECT_DATA];
-    unsigned int indirect_ptr;
+    unsigned int num_extents; //in the inode, while depth is 0
+    extent_t extents[INODE_EXTENTS];
+    unsigned int indirect_ptr; //root of the extent tree once there are more than INODE_EXTENTS
+    unsigned int flags;
+    unsigned int depth; //levels of the extent tree, the root included
 } inode_t;
 
-typedef struct indirect_data{
-    unsigned int data_ptrs[MAX_DATA_PER_INDIRECT];
-} indirect_t;
+//a block of the extent tree: the header, then extents in a leaf (level 0)
+//or index entries pointing at the nodes one level down
+typedef struct tree_node {
+    unsigned int count;
+    unsigned int level;
+} tree_node_t;
+
+typedef struct index_entry {
+    unsigned int logical; //extents below start here or later, lookups before the second entry take the first
+    unsigned int block;
+} index_entry_t;
 
 typedef struct dir_entry { 
 	char name[MAXFILENAME];
@@ -62,6 +98,14 @@ typedef struct dir_entry {
 typedef struct fd_table { 
 	unsigned int inode_idx;
 	unsigned int rd_write_ptr;
+    unsigned int ra_next;   //where a sequential read would start
+    unsigned int ra_window; //blocks to keep ahead, 0 while access is random
+    unsigned int ra_end;    //first block not prefetched yet
+    unsigned int delay_first;  //file blocks [delay_first, delay_first + delay_blocks) have no disk
+    unsigned int delay_blocks; //block yet, their data is in delay_data
+    unsigned int delay_claim;  //free blocks counted as taken for them and the tree blocks they may need
+    unsigned int delay_size;   //blocks delay_data holds, 0 until the first block is held back
+    char *delay_data;
 } fd_table_t;
 
 
@@ -0,0 +1,953 @@
+/* sfs_bench.c
+ *
+ * Benchmarks for the emulated disk and the file system. Each benchmark
+ * is selected by name on the command line; run without arguments to
+ * get the list.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "disk_emu.h"
+#include "crc32c.h"
+#include "sfs_api.h"
+#include "dir_index.h"
+
+#define BENCH_DISK "bench.disk"
+
+/* now_ms() - monotonic wall clock in milliseconds.
+ */
+static double now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* bench_format() - time init_fresh_disk for growing image sizes.
+ *
+ * Images are created sparse, so both the time and the space actually
+ * allocated on the host should stay flat as the image grows.
+ */
+static int bench_format(int argc, char **argv)
+{
+  static const long long sizes[] = { 1LL << 20, 1LL << 30, 16LL << 30 };
+  static const char *labels[] = { "1 MB", "1 GB", "16 GB" };
+  const int block_size = 512;
+  struct stat st;
+  double start, elapsed;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    start = now_ms();
+    if (init_fresh_disk(BENCH_DISK, block_size, (int)(sizes[i] / block_size)) < 0) {
+      fprintf(stderr, "ERROR: could not create %s image\n", labels[i]);
+      return 1;
+    }
+    close_disk();
+    elapsed = now_ms() - start;
+
+    stat(BENCH_DISK, &st);
+    printf("format %-6s %10.3f ms  apparent %lld bytes, allocated %lld bytes\n",
+           labels[i], elapsed, (long long)st.st_size, (long long)st.st_blocks * 512);
+    unlink(BENCH_DISK);
+  }
+  return 0;
+}
+
+/* bench_alloc() - count heap allocations made by the transfer path.
+ *
+ * Every buffer the disk emulator and the block cache use comes from
+ * disk_alloc_buffer, which counts them. Once the file system is up,
+ * reading and writing should not move the counter at all. The first
+ * write is left out: it gives the handle its delay buffer.
+ */
+static int bench_alloc(int argc, char **argv)
+{
+  char buf[1000];
+  unsigned long before;
+  int fd, i, rounds = 1000;
+  double start;
+
+  mksfs(1);
+  fd = sfs_fopen("alloc.txt");
+  memset(buf, 'x', sizeof(buf));
+  sfs_fwrite(fd, buf, sizeof(buf));
+
+  before = disk_counters.allocations;
+  start = now_ms();
+  for (i = 0; i < rounds; i++) {
+    sfs_fseek(fd, 0);
+    sfs_fwrite(fd, buf, sizeof(buf));
+    sfs_fseek(fd, 0);
+    sfs_fread(fd, buf, sizeof(buf));
+  }
+  printf("%d write+read rounds in %.3f ms, %lu allocations\n", rounds, now_ms() - start,
+         disk_counters.allocations - before);
+  sfs_fclose(fd);
+  return disk_counters.allocations != before;
+}
+
+/* bench_model() - run a small workload against a simulated device.
+ *
+ * The device model charges latency, seek distance and bandwidth to a
+ * virtual clock instead of sleeping, so the numbers are repeatable and
+ * the run takes no longer than the file system work itself.
+ */
+static int bench_model(int argc, char **argv)
+{
+  static const int depths[] = { 1, 8 };
+  disk_model_t model = { 100.0, 2.0, 100.0, 1, -1.0, 3, 1 };
+  char buf[100];
+  int i, j, fd;
+  double start;
+
+  memset(buf, 'm', sizeof(buf));
+  for (i = 0; i < 2; i++) {
+    model.queue_depth = depths[i];
+    disk_set_model(&model);
+    start = now_ms();
+
+    mksfs(1);
+    fd = sfs_fopen("model.txt");
+    for (j = 0; j < 50; j++) {
+      sfs_fwrite(fd, buf, sizeof(buf));
+    }
+    sfs_fclose(fd);
+    mksfs(0);
+    fd = sfs_fopen("model.txt");
+    for (j = 0; j < 50; j++) {
+      sfs_fread(fd, buf, sizeof(buf));
+    }
+    sfs_fclose(fd);
+
+    printf("queue depth %d: %.0f us simulated, %.3f ms wall\n", depths[i],
+           disk_clock_us(), now_ms() - start);
+  }
+  return 0;
+}
+
+/* bench_merge() - I/O count with and without the elevator.
+ *
+ * Four files are appended to in small interleaved chunks and then
+ * synced, so the flush carries metadata blocks and data blocks of
+ * several files at once. The noop scheduler issues them one by one in
+ * cache order; the elevator sorts them and merges the adjacent ones.
+ */
+static int bench_merge(int argc, char **argv)
+{
+  static const int schedulers[] = { DISK_SCHED_NOOP, DISK_SCHED_ELEVATOR };
+  static const char *labels[] = { "noop", "elevator" };
+  static const char *names[] = { "a.log", "b.log", "c.log", "d.log" };
+  disk_model_t idle = { 0.0, 0.0, 0.0, 1, -1.0, 3, 1 };
+  disk_model_t model = { 100.0, 2.0, 100.0, 1, -1.0, 3, 1 };
+  unsigned long requests, dispatched, syscalls;
+  char buf[100];
+  int fds[4];
+  int i, j, k;
+
+  memset(buf, 'g', sizeof(buf));
+  for (i = 0; i < 2; i++) {
+    disk_set_scheduler(schedulers[i]);
+    disk_set_model(&idle);
+    mksfs(1);
+    for (k = 0; k < 4; k++) {
+      fds[k] = sfs_fopen((char *)names[k]);
+    }
+    for (j = 0; j < 40; j++) {
+      for (k = 0; k < 4; k++) {
+        sfs_fwrite(fds[k], buf, sizeof(buf));
+      }
+    }
+
+    disk_set_model(&model);
+    requests = disk_counters.requests;
+    dispatched = disk_counters.dispatched;
+    syscalls = disk_counters.syscalls;
+    sfs_sync();
+    printf("%-8s sync: %lu requests, %lu transfers, %lu syscalls, %.0f us simulated\n", labels[i],
+           disk_counters.requests - requests, disk_counters.dispatched - dispatched,
+           disk_counters.syscalls - syscalls, disk_clock_us());
+
+    for (k = 0; k < 4; k++) {
+      sfs_fclose(fds[k]);
+    }
+  }
+  disk_set_scheduler(DISK_SCHED_ELEVATOR);
+  return 0;
+}
+
+/* bench_stripe() - sequential bandwidth over 1, 2 and 4 striped images.
+ *
+ * A 256 MB disk of 4 KB blocks is written and read back 1 MB at a time.
+ * The member images go in the directory given as the first argument
+ * (default: the current one); put them on separate devices to see the
+ * bandwidth scale with the member count.
+ */
+static int bench_stripe(int argc, char **argv)
+{
+  static const int counts[] = { 1, 2, 4 };
+  const int block_size = 4096, num_blocks = 65536, chunk = 256, stripe = 16;
+  const char *dir = argc > 1 ? argv[1] : ".";
+  char names[4][256];
+  char *members[4];
+  char *buf;
+  double start, write_ms, read_ms;
+  int i, j, k;
+
+  buf = disk_alloc_buffer((size_t)chunk * block_size);
+  memset(buf, 's', (size_t)chunk * block_size);
+  for (k = 0; k < 4; k++) {
+    snprintf(names[k], sizeof(names[k]), "%s/%s.%d", dir, BENCH_DISK, k);
+    members[k] = names[k];
+  }
+
+  for (i = 0; i < 3; i++) {
+    if (init_fresh_disk_striped(members, counts[i], stripe, block_size, num_blocks) < 0) {
+      fprintf(stderr, "ERROR: could not create %d striped images in %s\n", counts[i], dir);
+      return 1;
+    }
+
+    start = now_ms();
+    for (j = 0; j < num_blocks; j += chunk) {
+      write_blocks(j, chunk, buf);
+    }
+    sync_disk();
+    write_ms = now_ms() - start;
+
+    start = now_ms();
+    for (j = 0; j < num_blocks; j += chunk) {
+      read_blocks(j, chunk, buf);
+    }
+    read_ms = now_ms() - start;
+
+    printf("%d member(s): write %7.1f MB/s, read %7.1f MB/s\n", counts[i],
+           256 / (write_ms / 1000), 256 / (read_ms / 1000));
+    close_disk();
+    for (k = 0; k < counts[i]; k++) {
+      unlink(members[k]);
+    }
+  }
+  disk_free_buffer(buf);
+  return 0;
+}
+
+/* bench_csum() - read throughput with and without block checksums.
+ *
+ * A 64 MB image of 4 KB blocks is read 1 MB at a time, first as is,
+ * then checking every block against a CRC32C table with the software
+ * and (when the CPU has it) the hardware implementation.
+ */
+static int bench_csum(int argc, char **argv)
+{
+  const int block_size = 4096, num_blocks = 16384, chunk = 256, rounds = 4;
+  unsigned int *table;
+  char *buf;
+  double start, elapsed;
+  int mode, r, i, j, bad = 0;
+
+  table = malloc(num_blocks * sizeof(unsigned int));
+  buf = disk_alloc_buffer((size_t)chunk * block_size);
+  if (init_fresh_disk(BENCH_DISK, block_size, num_blocks) < 0) {
+    fprintf(stderr, "ERROR: could not create image\n");
+    return 1;
+  }
+  for (j = 0; j < num_blocks; j += chunk) {
+    for (i = 0; i < chunk * block_size; i++) {
+      buf[i] = (char)(i * 31 + j);
+    }
+    for (i = 0; i < chunk; i++) {
+      table[j + i] = crc32c(0, buf + (size_t)i * block_size, block_size);
+    }
+    write_blocks(j, chunk, buf);
+  }
+
+  for (mode = 0; mode < 3; mode++) {
+    crc32c_force_software(mode == 1);
+    start = now_ms();
+    for (r = 0; r < rounds; r++) {
+      for (j = 0; j < num_blocks; j += chunk) {
+        read_blocks(j, chunk, buf);
+        for (i = 0; mode > 0 && i < chunk; i++) {
+          bad += crc32c(0, buf + (size_t)i * block_size, block_size) != table[j + i];
+        }
+      }
+    }
+    elapsed = now_ms() - start;
+    printf("%-22s %8.1f MB/s\n", mode == 0 ? "unverified" : crc32c_engine(),
+           rounds * 64 / (elapsed / 1000));
+  }
+
+  close_disk();
+  unlink(BENCH_DISK);
+  disk_free_buffer(buf);
+  free(table);
+  return bad != 0;
+}
+
+/* bench_compress() - blocks written and throughput with compressed files.
+ *
+ * A file is filled with log lines, which compress well, then with random
+ * bytes, which do not, and read back; each once stored as is and once
+ * with sfs_fcompress. Compression should cut the blocks written for the
+ * logs and cost little more than the cluster rewrites for random data.
+ */
+static int bench_compress(int argc, char **argv)
+{
+  static const char *line = "2026-10-18 12:00:00 INFO request served in 3 ms\n";
+  const int file_size = 5000, chunk = 100, rounds = 200;
+  char data[5000], back[5000];
+  unsigned long written;
+  double start, write_ms, read_ms;
+  int input, compressed, fd, r, j, bad = 0;
+
+  for (input = 0; input < 2; input++) {
+    for (j = 0; j < file_size; j++) {
+      data[j] = input == 0 ? line[j % strlen(line)] : (char)rand();
+    }
+    for (compressed = 0; compressed < 2; compressed++) {
+      mksfs(1);
+      fd = sfs_fopen("compress.log");
+      sfs_fcompress(fd, compressed);
+      written = disk_counters.blocks_written;
+
+      start = now_ms();
+      for (r = 0; r < rounds; r++) {
+        sfs_fseek(fd, 0);
+        for (j = 0; j < file_size; j += chunk) {
+          sfs_fwrite(fd, data + j, chunk);
+        }
+        sfs_fsync(fd);
+      }
+      write_ms = now_ms() - start;
+      written = disk_counters.blocks_written - written;
+
+      start = now_ms();
+      for (r = 0; r < rounds; r++) {
+        sfs_fseek(fd, 0);
+        for (j = 0; j < file_size; j += chunk) {
+          sfs_fread(fd, back + j, chunk);
+        }
+      }
+      read_ms = now_ms() - start;
+      bad += memcmp(data, back, file_size) != 0;
+
+      printf("%-6s %-10s %6.1f blocks written per fsync, write %6.1f MB/s, read %6.1f MB/s\n",
+             input == 0 ? "logs" : "random", compressed ? "compressed" : "plain", (double)written / rounds,
+             rounds * file_size / 1e6 / (write_ms / 1000), rounds * file_size / 1e6 / (read_ms / 1000));
+      sfs_fclose(fd);
+    }
+  }
+  return bad != 0;
+}
+
+/* bench_stats() - write amplification of small appends.
+ *
+ * A 5000 byte file is appended to in chunks of growing size, fsynced
+ * after every chunk and then only once at the end. The I/O statistics
+ * of the last run are dumped as JSON to the file given as the first
+ * argument, or to stdout.
+ */
+static int bench_stats(int argc, char **argv)
+{
+  static const int chunks[] = { 10, 100, 512 };
+  const int file_size = 5000;
+  char buf[512];
+  FILE *out;
+  int c, each, fd, j;
+
+  memset(buf, 'w', sizeof(buf));
+  for (each = 1; each >= 0; each--) {
+    for (c = 0; c < 3; c++) {
+      mksfs(1);
+      fd = sfs_fopen("stats.log");
+      disk_stats_reset();
+      for (j = 0; j < file_size; j += chunks[c]) {
+        sfs_fwrite(fd, buf, j + chunks[c] > file_size ? file_size - j : chunks[c]);
+        if (each) {
+          sfs_fsync(fd);
+        }
+      }
+      sfs_fsync(fd);
+      printf("%3d byte appends, fsync %-10s write amplification %6.2f\n", chunks[c],
+             each ? "each" : "at the end", disk_stats_write_amplification());
+      sfs_fclose(fd);
+    }
+  }
+
+  out = argc > 1 ? fopen(argv[1], "w") : stdout;
+  if (out == NULL) {
+    fprintf(stderr, "ERROR: could not open %s\n", argv[1]);
+    return 1;
+  }
+  disk_stats_json(out);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
+
+/* bench_readahead() - streaming a cold file with and without read-ahead.
+ *
+ * A 5000 byte file is read front to back in 100 byte chunks after a
+ * remount, on a simulated device that takes 100 us per request and
+ * serves 8 at once. Without read-ahead every block is a synchronous
+ * miss; with it the next blocks are already in flight together.
+ */
+static int bench_readahead(int argc, char **argv)
+{
+  static const int windows[] = { 0, 8 };
+  disk_model_t idle = { 0.0, 0.0, 0.0, 1, -1.0, 3, 1 };
+  disk_model_t model = { 100.0, 0.0, 0.0, 8, -1.0, 3, 1 };
+  const int file_size = 5000, chunk = 100;
+  char data[5000], back[5000];
+  int i, j, fd, bad = 0;
+
+  for (j = 0; j < file_size; j++) {
+    data[j] = (char)(j * 7);
+  }
+  for (i = 0; i < 2; i++) {
+    disk_set_model(&idle);
+    mksfs(1);
+    fd = sfs_fopen("stream.log");
+    sfs_fwrite(fd, data, file_size);
+    sfs_fclose(fd);
+    mksfs(0);
+
+    sfs_set_readahead(windows[i]);
+    disk_set_model(&model);
+    fd = sfs_fopen("stream.log");
+    for (j = 0; j < file_size; j += chunk) {
+      sfs_fread(fd, back + j, chunk);
+    }
+    bad += memcmp(data, back, file_size) != 0;
+    printf("read-ahead %-3s %6.0f us simulated\n", windows[i] ? "on" : "off", disk_clock_us());
+    sfs_fclose(fd);
+  }
+  disk_set_model(&idle);
+  return bad != 0;
+}
+
+/* bench_extent() - transfers needed to read back a file.
+ *
+ * A 20000 byte file is written once on its own, so it gets a single
+ * extent, and once in 512 byte appends alternating with a second file,
+ * so every block is an extent of its own. After a remount it is read
+ * back with one sfs_fread; each extent should cost one transfer.
+ * Allocation is not delayed here, that would keep the blocks together.
+ */
+static int bench_extent(int argc, char **argv)
+{
+  static const char *labels[] = { "contiguous", "interleaved" };
+  const int file_size = 20000, chunk = 512;
+  static char data[20000], back[20000];
+  unsigned long dispatched, syscalls;
+  int layout, fd, other, j, bad = 0;
+
+  memset(data, 'e', sizeof(data));
+  sfs_set_delayed_alloc(0);
+  for (layout = 0; layout < 2; layout++) {
+    mksfs(1);
+    fd = sfs_fopen("extent.log");
+    other = sfs_fopen("other.log");
+    for (j = 0; j < file_size; j += chunk) {
+      sfs_fwrite(fd, data + j, j + chunk > file_size ? file_size - j : chunk);
+      if (layout == 1) {
+        sfs_fwrite(other, data, chunk);
+      }
+    }
+    sfs_fclose(other);
+    mksfs(0);
+
+    dispatched = disk_counters.dispatched;
+    syscalls = disk_counters.syscalls;
+    sfs_fseek(fd, 0);
+    bad += sfs_fread(fd, back, file_size) != file_size || memcmp(data, back, file_size) != 0;
+    printf("%-11s %2lu transfers, %2lu syscalls to read %d blocks\n", labels[layout],
+           disk_counters.dispatched - dispatched, disk_counters.syscalls - syscalls, (file_size + 511) / 512);
+    sfs_fclose(fd);
+  }
+  sfs_set_delayed_alloc(64);
+  return bad != 0;
+}
+
+/* bench_delalloc() - layout left by small appends to several files.
+ *
+ * Three files get the 45 byte line of sfs_test.c appended in turn until
+ * each holds 12000 bytes, once with blocks allocated as the writes come
+ * in and once with allocation delayed until sfs_fclose. After a remount
+ * the first file is read with one sfs_fread on a simulated device where
+ * seeks cost 5 us per block of distance.
+ */
+static int bench_delalloc(int argc, char **argv)
+{
+  static const char line[] = "The quick brown fox jumps over the lazy dog.\n";
+  static const char *names[] = { "append.0", "append.1", "append.2" };
+  disk_model_t idle = { 0.0, 0.0, 0.0, 1, -1.0, 3, 1 };
+  disk_model_t model = { 100.0, 5.0, 0.0, 1, -1.0, 3, 1 };
+  const int file_size = 12000, len = sizeof(line) - 1;
+  static char back[12000];
+  unsigned long dispatched;
+  int delayed, fds[3], i, j, bad = 0;
+  double us;
+
+  for (delayed = 0; delayed < 2; delayed++) {
+    disk_set_model(&idle);
+    sfs_set_delayed_alloc(delayed ? 64 : 0);
+    mksfs(1);
+    for (i = 0; i < 3; i++) {
+      fds[i] = sfs_fopen((char *)names[i]);
+    }
+    for (j = 0; j < file_size; j += len) {
+      for (i = 0; i < 3; i++) {
+        sfs_fwrite(fds[i], line, j + len > file_size ? file_size - j : len);
+      }
+    }
+    for (i = 0; i < 3; i++) {
+      sfs_fclose(fds[i]);
+    }
+    mksfs(0);
+
+    disk_set_model(&model);
+    dispatched = disk_counters.dispatched;
+    fds[0] = sfs_fopen((char *)names[0]);
+    bad += sfs_fread(fds[0], back, file_size) != file_size;
+    for (j = 0; j < file_size; j++) {
+      bad += back[j] != line[j % len];
+    }
+    us = disk_clock_us();
+    printf("allocation %-7s %2lu transfers, %6.0f us simulated, %5.1f MB/s\n", delayed ? "delayed" : "at write",
+           disk_counters.dispatched - dispatched, us, file_size / us);
+    sfs_fclose(fds[0]);
+  }
+  disk_set_model(&idle);
+  sfs_set_delayed_alloc(64);
+  return bad != 0;
+}
+
+/* bench_fallocate() - layout of fsync'd logs with and without reservation.
+ *
+ * Two 20000 byte logs get 500 byte records in turn, each followed by an
+ * sfs_fsync, so delayed allocation has only one record to place at a
+ * time. In the second run both logs are reserved with sfs_fallocate
+ * first. The first log is then read back on the simulated device of
+ * bench_delalloc.
+ */
+static int bench_fallocate(int argc, char **argv)
+{
+  static const char *names[] = { "log.0", "log.1" };
+  disk_model_t idle = { 0.0, 0.0, 0.0, 1, -1.0, 3, 1 };
+  disk_model_t model = { 100.0, 5.0, 0.0, 1, -1.0, 3, 1 };
+  const int file_size = 20000, record = 500;
+  static char data[20000], back[20000];
+  unsigned long dispatched;
+  int reserve, fds[2], i, j, bad = 0;
+  double us;
+
+  for (j = 0; j < file_size; j++) {
+    data[j] = (char)(j * 13);
+  }
+  for (reserve = 0; reserve < 2; reserve++) {
+    disk_set_model(&idle);
+    mksfs(1);
+    for (i = 0; i < 2; i++) {
+      fds[i] = sfs_fopen((char *)names[i]);
+      if (reserve) {
+        bad += sfs_fallocate(fds[i], 0, file_size) != 0;
+      }
+    }
+    for (j = 0; j < file_size; j += record) {
+      for (i = 0; i < 2; i++) {
+        sfs_fwrite(fds[i], data + j, record);
+        sfs_fsync(fds[i]);
+      }
+    }
+    for (i = 0; i < 2; i++) {
+      sfs_fclose(fds[i]);
+    }
+    mksfs(0);
+
+    disk_set_model(&model);
+    dispatched = disk_counters.dispatched;
+    fds[0] = sfs_fopen((char *)names[0]);
+    bad += sfs_fread(fds[0], back, file_size) != file_size || memcmp(data, back, file_size) != 0;
+    us = disk_clock_us();
+    printf("%-10s %2lu transfers, %6.0f us simulated, %5.1f MB/s\n", reserve ? "fallocate" : "no reserve",
+           disk_counters.dispatched - dispatched, us, file_size / us);
+    sfs_fclose(fds[0]);
+  }
+  disk_set_model(&idle);
+  return bad != 0;
+}
+
+/* bench_inodes() - cost of a create as the file count grows.
+ *
+ * A million files are created with sfs_fopen and closed again on a
+ * 4 KB block file system with room for 1 << 20 inodes, timed per
+ * 100000, so every create pays for the inode map, the directory index
+ * and the inode table. Then one file in ten is removed at random and
+ * created again. For comparison, the first 40000 inodes are also taken
+ * with the linear scan for a zero link count that get_free_inode used
+ * to do, whose cost per create grows with the inodes already in use.
+ * sfs_fopen and sfs_remove report on stdout, which goes to /dev/null
+ * while the files are made and removed.
+ */
+static int bench_inodes(int argc, char **argv)
+{
+  const unsigned int num_inodes = 1 << 20, files = 1000000, band = 100000, scan_inodes = 40000;
+  char name[MAXFILENAME];
+  char *removed;
+  unsigned int *links, i, j, got, n, again = 0, bad = 0;
+  double start, elapsed;
+  int out, quiet, fd;
+
+  if (sfs_set_geometry(4096, 65536, num_inodes) < 0) {
+    return 1;
+  }
+  mksfs(1);
+  removed = calloc(files, 1);
+  fflush(stdout);
+  out = dup(STDOUT_FILENO);
+  quiet = open("/dev/null", O_WRONLY);
+
+  for (i = 0; i < files; i += n) {
+    n = files - i < band ? files - i : band;
+    dup2(quiet, STDOUT_FILENO);
+    start = now_ms();
+    for (j = i; j < i + n; j++) {
+      snprintf(name, sizeof(name), "i%07u.dat", j);
+      fd = sfs_fopen(name);
+      bad += fd < 0 || sfs_fclose(fd) != 0;
+    }
+    elapsed = now_ms() - start;
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    printf("sfs_fopen  %7u..%-7u %6.2f us/create\n", i, i + n - 1, elapsed * 1e3 / n);
+  }
+
+  srand(1);
+  dup2(quiet, STDOUT_FILENO);
+  for (i = 0; i < files / 10; i++) {
+    j = (unsigned int)rand() % files;
+    if (!removed[j]) {
+      snprintf(name, sizeof(name), "i%07u.dat", j);
+      bad += sfs_remove(name) != 0;
+      removed[j] = 1;
+      again++;
+    }
+  }
+  start = now_ms();
+  for (j = 0; j < files; j++) {
+    if (removed[j]) {
+      snprintf(name, sizeof(name), "i%07u.dat", j);
+      fd = sfs_fopen(name);
+      bad += fd < 0 || sfs_fclose(fd) != 0;
+    }
+  }
+  elapsed = now_ms() - start;
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  printf("sfs_fopen  %u removed at random, created again: %6.2f us/create\n", again, elapsed * 1e3 / again);
+  bad += sfs_getfilesize("i0999999.dat") != 0;
+  close(quiet);
+  close(out);
+  free(removed);
+
+  links = calloc(scan_inodes, sizeof(unsigned int));
+  links[0] = 1;
+  for (i = 1; i < scan_inodes; i += n) {
+    n = 10000 - (i == 1);
+    start = now_ms();
+    for (j = 0; j < n; j++) {
+      for (got = 1; got < scan_inodes && links[got]; got++) {
+      }
+      links[got] = 1;
+    }
+    printf("scan       %7u..%-7u %6.2f us/create\n", i, i + n - 1, (now_ms() - start) * 1e3 / n);
+  }
+  free(links);
+  sfs_set_geometry(512, 100, 5);
+  unlink("sfs_disk.disk");
+  return bad != 0;
+}
+
+/* bench_dir() - cost of a lookup as the directory grows.
+ *
+ * Directories of 10, 10000 and 1000000 entries are filled to three
+ * quarters of their 512 byte blocks, then looked up by random names
+ * that are there and names that are not. The hashed index should read
+ * about one block per lookup at every size; the linear strcmp over all
+ * the entries that get_directory_ptr_from_name used to do is timed for
+ * comparison.
+ */
+static int bench_dir(int argc, char **argv)
+{
+  static const unsigned int sizes[] = { 10, 10000, 1000000 };
+  const unsigned int per_block = 512 / sizeof(dir_entry_t), lookups = 200000;
+  dir_entry_t *entries;
+  char name[MAXFILENAME];
+  unsigned int num_blocks, n, i, j, slot, bad = 0;
+  unsigned long scanned;
+  double start, found_ns, missing_ns, scan_ns;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    n = sizes[i];
+    num_blocks = (n * 4 / 3 + per_block) / per_block;
+    entries = calloc((size_t)num_blocks * per_block, sizeof(dir_entry_t));
+    if (!entries || dir_init(entries, num_blocks, per_block) < 0) {
+      fprintf(stderr, "ERROR: could not allocate the directory\n");
+      return 1;
+    }
+    start = now_ms();
+    for (j = 0; j < n; j++) {
+      snprintf(name, sizeof(name), "F%08u.DAT", j);
+      bad += !dir_insert(name, j + 1);
+    }
+    printf("%7u entries, %6u blocks: %6.1f ns/insert\n", n, num_blocks, (now_ms() - start) * 1e6 / n);
+
+    srand(1);
+    scanned = dir_blocks_scanned;
+    start = now_ms();
+    for (j = 0; j < lookups; j++) {
+      snprintf(name, sizeof(name), "F%08u.DAT", (unsigned int)rand() % n);
+      slot = dir_lookup(name);
+      bad += !slot || strcmp(entries[slot].name, name) != 0;
+    }
+    found_ns = (now_ms() - start) * 1e6 / lookups;
+    printf("  found   %6.1f ns/lookup, %.2f blocks\n", found_ns, (double)(dir_blocks_scanned - scanned) / lookups);
+
+    scanned = dir_blocks_scanned;
+    start = now_ms();
+    for (j = 0; j < lookups; j++) {
+      snprintf(name, sizeof(name), "M%08u.DAT", (unsigned int)rand() % n);
+      bad += dir_lookup(name) != 0;
+    }
+    missing_ns = (now_ms() - start) * 1e6 / lookups;
+    printf("  missing %6.1f ns/lookup, %.2f blocks\n", missing_ns, (double)(dir_blocks_scanned - scanned) / lookups);
+
+    start = now_ms();
+    for (j = 0; j < 100; j++) {
+      snprintf(name, sizeof(name), "F%08u.DAT", (unsigned int)rand() % n);
+      for (slot = 1; slot < num_blocks * per_block; slot++) {
+        if (entries[slot].inode_idx && strcmp(entries[slot].name, name) == 0) break;
+      }
+      bad += slot == num_blocks * per_block;
+    }
+    scan_ns = (now_ms() - start) * 1e6 / 100;
+    printf("  linear  %10.1f ns/lookup\n", scan_ns);
+
+    dir_close();
+    free(entries);
+  }
+  return bad != 0;
+}
+
+/* bench_blocksize() - sequential throughput for several block sizes.
+ *
+ * A 32 MB file is written 1 MB at a time on a 64 MB file system made
+ * with 512 byte, 4 KB and 64 KB blocks, closed, and read back 1 MB at
+ * a time after a remount. Bigger blocks mean fewer extents to map,
+ * fewer checksums and cache lookups, and fewer, larger transfers.
+ */
+static int bench_blocksize(int argc, char **argv)
+{
+  static const int sizes[] = { 512, 4096, 65536 };
+  const int image = 64 << 20, file_size = 32 << 20, chunk = 1 << 20;
+  char *data = malloc(chunk), *back = malloc(chunk);
+  unsigned long dispatched;
+  double start, write_ms, read_ms;
+  int i, j, fd, bad = 0;
+
+  for (j = 0; j < chunk; j++) {
+    data[j] = (char)(j * 7 + j / 4096);
+  }
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (sfs_set_geometry(sizes[i], image / sizes[i], 16) < 0) {
+      return 1;
+    }
+    mksfs(1);
+    start = now_ms();
+    fd = sfs_fopen("big.dat");
+    for (j = 0; j < file_size; j += chunk) {
+      bad += sfs_fwrite(fd, data, chunk) != chunk;
+    }
+    sfs_fclose(fd);
+    sfs_sync();
+    write_ms = now_ms() - start;
+
+    mksfs(0);
+    dispatched = disk_counters.dispatched;
+    start = now_ms();
+    fd = sfs_fopen("big.dat");
+    for (j = 0; j < file_size; j += chunk) {
+      bad += sfs_fread(fd, back, chunk) != chunk || memcmp(data, back, chunk) != 0;
+    }
+    read_ms = now_ms() - start;
+    printf("%5d byte blocks: write %7.1f MB/s, read %7.1f MB/s in %5lu transfers\n", sizes[i],
+           32 / (write_ms / 1000), 32 / (read_ms / 1000), disk_counters.dispatched - dispatched);
+    sfs_fclose(fd);
+  }
+  sfs_set_geometry(512, 100, 5);
+  free(data);
+  free(back);
+  return bad != 0;
+}
+
+/* bench_mount() - cold mount time for growing images.
+ *
+ * 4 KB block file systems of 64 MB, 1 GB and 16 GB, all with 1024
+ * inodes, get a few files written and synced by one process and are
+ * mounted with mksfs(0) by another, so nothing is left in memory. Only
+ * the superblock, the maps and the directory are read at mount, in a
+ * few large transfers, and the checksum and inode tables come in as
+ * they are used, so the time should barely move with the image size.
+ */
+static int bench_mount(int argc, char **argv)
+{
+  static const long long sizes[] = { 64LL << 20, 1LL << 30, 16LL << 30 };
+  static const char *labels[] = { "64 MB", "1 GB", "16 GB" };
+  const int block_size = 4096;
+  char name[MAXFILENAME], data[4096];
+  unsigned long syscalls;
+  double start;
+  int i, j, fd, status, bad = 0;
+
+  memset(data, 'm', sizeof(data));
+  for (i = 0; i < 3; i++) {
+    if (sfs_set_geometry(block_size, (int)(sizes[i] / block_size), 1024) < 0) {
+      return 1;
+    }
+    if (fork() == 0) {
+      mksfs(1);
+      for (j = 0; j < 100; j++) {
+        snprintf(name, sizeof(name), "f%03d.dat", j);
+        fd = sfs_fopen(name);
+        sfs_fwrite(fd, data, sizeof(data));
+        sfs_fclose(fd);
+      }
+      _exit(sfs_sync() < 0);
+    }
+    wait(&status);
+    bad += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+    if (fork() == 0) {
+      syscalls = disk_counters.syscalls;
+      start = now_ms();
+      if (mksfs(0) < 0) {
+        _exit(1);
+      }
+      printf("mount %-6s %8.3f ms in %4lu syscalls, file size %d\n", labels[i], now_ms() - start,
+             disk_counters.syscalls - syscalls, sfs_getfilesize("f042.dat"));
+      _exit(sfs_getfilesize("f042.dat") != sizeof(data));
+    }
+    wait(&status);
+    bad += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  sfs_set_geometry(512, 100, 5);
+  unlink("sfs_disk.disk");
+  return bad != 0;
+}
+
+/* bench_metadata() - blocks written by a metadata heavy workload.
+ *
+ * 2000 files of 100 bytes are created one after the other on a 64 MB
+ * file system with 4 KB blocks and 16384 inodes, then every other one
+ * is removed, and the blocks handed to the disk are counted up to the
+ * final sfs_sync. Each call only changes a few entries of the inode
+ * table, the directory and the maps, so only their blocks should be
+ * written back, not the whole tables.
+ */
+static int bench_metadata(int argc, char **argv)
+{
+  const int files = 2000;
+  char name[MAXFILENAME], data[100];
+  unsigned long written;
+  double start;
+  int i, fd, bad = 0;
+
+  memset(data, 'd', sizeof(data));
+  if (sfs_set_geometry(4096, 16384, 16384) < 0) {
+    return 1;
+  }
+  mksfs(1);
+  written = disk_counters.blocks_written;
+  start = now_ms();
+  for (i = 0; i < files; i++) {
+    snprintf(name, sizeof(name), "m%05d.dat", i);
+    fd = sfs_fopen(name);
+    bad += sfs_fwrite(fd, data, sizeof(data)) != sizeof(data);
+    bad += sfs_fclose(fd) != 0;
+  }
+  bad += sfs_sync() != 0;
+  printf("create %d files: %8.1f ms, %7lu blocks written, %6.1f per file\n", files, now_ms() - start,
+         disk_counters.blocks_written - written, (double)(disk_counters.blocks_written - written) / files);
+
+  written = disk_counters.blocks_written;
+  start = now_ms();
+  for (i = 0; i < files; i += 2) {
+    snprintf(name, sizeof(name), "m%05d.dat", i);
+    bad += sfs_remove(name) != 0;
+  }
+  bad += sfs_sync() != 0;
+  printf("remove %d files: %8.1f ms, %7lu blocks written, %6.1f per file\n", files / 2, now_ms() - start,
+         disk_counters.blocks_written - written, (double)(disk_counters.blocks_written - written) / (files / 2));
+
+  mksfs(0);
+  for (i = 0; i < files; i++) {
+    snprintf(name, sizeof(name), "m%05d.dat", i);
+    bad += sfs_getfilesize(name) != (i % 2 ? (int)sizeof(data) : -1);
+  }
+  sfs_set_geometry(512, 100, 5);
+  return bad != 0;
+}
+
+static struct {
+  const char *name;
+  int (*run)(int argc, char **argv);
+  const char *help;
+} benches[] = {
+  { "format", bench_format, "time to create 1 MB, 1 GB and 16 GB images" },
+  { "alloc", bench_alloc, "heap allocations made by sfs_fwrite/sfs_fread" },
+  { "model", bench_model, "simulated device time for a write/read workload" },
+  { "merge", bench_merge, "I/O count of a sync with and without request merging" },
+  { "stripe", bench_stripe, "sequential bandwidth over 1, 2 and 4 striped images" },
+  { "csum", bench_csum, "read throughput with and without CRC32C verification" },
+  { "compress", bench_compress, "blocks written and throughput with compressed files" },
+  { "stats", bench_stats, "write amplification of small appends, with a JSON dump" },
+  { "extent", bench_extent, "transfers to read a contiguous and a fragmented file" },
+  { "readahead", bench_readahead, "simulated time to stream a cold file with and without read-ahead" },
+  { "delalloc", bench_delalloc, "transfers and simulated time to read a file grown by small appends" },
+  { "fallocate", bench_fallocate, "transfers and simulated time to read an fsync'd log with and without sfs_fallocate" },
+  { "inodes", bench_inodes, "time per sfs_fopen create while a million files are made, against a linear scan" },
+  { "dir", bench_dir, "lookups in directories of 10, 10k and 1M entries, hashed and linear" },
+  { "blocksize", bench_blocksize, "sequential write and read throughput with 512 B, 4 KB and 64 KB blocks" },
+  { "mount", bench_mount, "cold mount time of 64 MB, 1 GB and 16 GB images" },
+  { "metadata", bench_metadata, "blocks written while 2000 small files are created and 1000 removed" },
+};
+
+int
+main(int argc, char **argv)
+{
+  int i;
+
+  setbuf(stdout, NULL);
+  if (argc > 1) {
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+      if (strcmp(argv[1], benches[i].name) == 0) {
+        return benches[i].run(argc - 1, argv + 1);
+      }
+    }
+  }
+
+  fprintf(stderr, "usage: %s <benchmark>\n", argv[0]);
+  for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    fprintf(stderr, "  %-10s %s\n", benches[i].name, benches[i].help);
+  }
+  return 1;
+}
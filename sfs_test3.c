@@ -0,0 +1,247 @@
+/* sfs_test3.c
+ *
+ * Corner cases that the random tests do not reach: held back blocks
+ * that need extent tree blocks to be placed, blocks reserved past the
+ * end of a file or over blocks a removed file used, removing a file
+ * that is open, and the size of a file that does not exist.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define BLOCK 512
+
+/* fill_block() - the contents block i of a test file should have.
+ */
+static void fill_block(char *buf, int i)
+{
+  memset(buf, 'a' + i % 26, BLOCK);
+}
+
+/* check_file() - reads nblocks blocks from the start of the file and
+ * counts the ones that do not hold what fill_block() put there.
+ */
+static int check_file(int fd, int nblocks, const char *what)
+{
+  char expect[BLOCK], got[BLOCK];
+  int i, errors = 0;
+
+  sfs_fseek(fd, 0);
+  for (i = 0; i < nblocks; i++) {
+    fill_block(expect, i);
+    if (sfs_fread(fd, got, BLOCK) != BLOCK || memcmp(expect, got, BLOCK) != 0) {
+      fprintf(stderr, "ERROR: %s: block %d of the file is wrong\n", what, i);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+/* test_held_blocks_fit() - fragments the free space so that a close
+ * has to place every held back block in a run of its own. Once the
+ * inode's extents are used up, that takes extent tree blocks too. A
+ * write that was accepted must fit, tree blocks included, so the close
+ * has to succeed and every block has to read back.
+ */
+static int test_held_blocks_fit(void)
+{
+  char buf[BLOCK];
+  int a, b, c, i, n, errors = 0;
+
+  mksfs(1);
+
+  /* Allocation at write time with two files interleaves their blocks
+   */
+  sfs_set_delayed_alloc(0);
+  a = sfs_fopen("FRAG_A.TXT");
+  b = sfs_fopen("FRAG_B.TXT");
+  for (i = 0;; i++) {
+    fill_block(buf, i);
+    if (sfs_fwrite(i % 2 ? b : a, buf, BLOCK) != BLOCK) {
+      break;
+    }
+  }
+  sfs_fclose(a);
+  sfs_fclose(b);
+  sfs_remove("FRAG_B.TXT");
+
+  /* Every free block is now on its own
+   */
+  sfs_set_delayed_alloc(64);
+  c = sfs_fopen("HELD.TXT");
+  for (n = 0;; n++) {
+    fill_block(buf, n);
+    if (sfs_fwrite(c, buf, BLOCK) != BLOCK) {
+      break;
+    }
+  }
+  if (n < 4) {
+    fprintf(stderr, "ERROR: only %d blocks could be written to the fragmented disk\n", n);
+    return errors + 1;
+  }
+
+  if (sfs_fclose(c) != 0) {
+    fprintf(stderr, "ERROR: close could not place the %d blocks that were written\n", n);
+    errors++;
+  }
+  c = sfs_fopen("HELD.TXT");
+  errors += check_file(c, n, "after the close");
+  if (sfs_getfilesize("HELD.TXT") != n * BLOCK) {
+    fprintf(stderr, "ERROR: file size %d, expected %d\n", sfs_getfilesize("HELD.TXT"), n * BLOCK);
+    errors++;
+  }
+  sfs_fclose(c);
+  sfs_remove("FRAG_A.TXT");
+  return errors;
+}
+
+/* test_fallocate_gap() - reserves a block well past the end of a file.
+ * The blocks between the old end and the reserved one are part of the
+ * file now and must read as zeros, after the bytes written before.
+ */
+static int test_fallocate_gap(void)
+{
+  char buf[4096 + BLOCK];
+  int fd, i, errors = 0, written = 100;
+
+  mksfs(1);
+  fd = sfs_fopen("GAP.TXT");
+  memset(buf, 'x', written);
+  if (sfs_fwrite(fd, buf, written) != written) {
+    fprintf(stderr, "ERROR: writing the start of the file failed\n");
+    errors++;
+  }
+  if (sfs_fallocate(fd, 4096, BLOCK) != 0) {
+    fprintf(stderr, "ERROR: reserving a block past the end of the file failed\n");
+    return errors + 1;
+  }
+  if (sfs_getfilesize("GAP.TXT") != sizeof(buf)) {
+    fprintf(stderr, "ERROR: file size %d after the reserve, expected %d\n",
+            sfs_getfilesize("GAP.TXT"), (int)sizeof(buf));
+    errors++;
+  }
+
+  memset(buf, '?', sizeof(buf));
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    fprintf(stderr, "ERROR: reading across the reserved gap came up short\n");
+    errors++;
+  }
+  for (i = 0; i < sizeof(buf); i++) {
+    if (buf[i] != (i < written ? 'x' : 0)) {
+      fprintf(stderr, "ERROR: wrong byte at offset %d after the reserve (%d)\n", i, buf[i]);
+      errors++;
+      break;
+    }
+  }
+  sfs_fclose(fd);
+  return errors;
+}
+
+/* test_fallocate_reused() - grows a file with a reserve over blocks
+ * that a removed file used. The bytes between the old end of the file
+ * and the end of its last block were never written, so they must read
+ * as zeros and not as what the removed file left there.
+ */
+static int test_fallocate_reused(void)
+{
+  char buf[2 * BLOCK];
+  int a, b, i, errors = 0, written = 100;
+
+  mksfs(1);
+  sfs_set_delayed_alloc(0);
+  a = sfs_fopen("OLD.TXT");
+  memset(buf, 'Z', sizeof(buf));
+  sfs_fwrite(a, buf, sizeof(buf));
+  sfs_fclose(a);
+  sfs_remove("OLD.TXT");
+
+  b = sfs_fopen("NEW.TXT");
+  memset(buf, 'n', written);
+  if (sfs_fwrite(b, buf, written) != written) {
+    fprintf(stderr, "ERROR: writing the start of the file failed\n");
+    errors++;
+  }
+  if (sfs_fallocate(b, 0, sizeof(buf)) != 0) {
+    fprintf(stderr, "ERROR: reserving over the reused blocks failed\n");
+    return errors + 1;
+  }
+
+  memset(buf, '?', sizeof(buf));
+  sfs_fseek(b, 0);
+  if (sfs_fread(b, buf, sizeof(buf)) != sizeof(buf)) {
+    fprintf(stderr, "ERROR: reading the reused blocks came up short\n");
+    errors++;
+  }
+  for (i = 0; i < sizeof(buf); i++) {
+    if (buf[i] != (i < written ? 'n' : 0)) {
+      fprintf(stderr, "ERROR: wrong byte at offset %d of the reused blocks (%d)\n", i, buf[i]);
+      errors++;
+      break;
+    }
+  }
+  sfs_fclose(b);
+  sfs_set_delayed_alloc(64);
+  return errors;
+}
+
+/* test_remove_open() - tries to remove a file while a handle to it
+ * is open and a block written through it is still held back. The
+ * remove must be refused, so the handle keeps working and the block
+ * reaches the file. Once the handle is closed the remove goes through.
+ */
+static int test_remove_open(void)
+{
+  char buf[BLOCK];
+  int a, errors = 0;
+
+  mksfs(1);
+  a = sfs_fopen("OPEN.TXT");
+  fill_block(buf, 0);
+  sfs_fwrite(a, buf, BLOCK);
+  if (sfs_remove("OPEN.TXT") == 0) {
+    fprintf(stderr, "ERROR: removing an open file succeeded\n");
+    errors++;
+  }
+  fill_block(buf, 1);
+  if (sfs_fwrite(a, buf, BLOCK) != BLOCK) {
+    fprintf(stderr, "ERROR: writing after the refused remove failed\n");
+    errors++;
+  }
+  errors += check_file(a, 2, "after the refused remove");
+  if (sfs_fclose(a) != 0) {
+    fprintf(stderr, "ERROR: closing the file after the refused remove failed\n");
+    errors++;
+  }
+  if (sfs_remove("OPEN.TXT") != 0 || sfs_getfilesize("OPEN.TXT") != -1) {
+    fprintf(stderr, "ERROR: removing the file once it was closed failed\n");
+    errors++;
+  }
+  return errors;
+}
+
+/* The main testing program
+ */
+int
+main(int argc, char **argv)
+{
+  int error_count = 0;
+
+  setbuf(stdout, NULL);
+  setbuf(stderr, NULL);
+
+  error_count += test_held_blocks_fit();
+  error_count += test_fallocate_gap();
+  error_count += test_fallocate_reused();
+  error_count += test_remove_open();
+
+  if (sfs_getfilesize("NOSUCH.TXT") != -1) {
+    fprintf(stderr, "ERROR: size %d for a file that does not exist\n", sfs_getfilesize("NOSUCH.TXT"));
+    error_count++;
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}